@@ -0,0 +1,80 @@
+#!/bin/bash
+
+# Runs decipherment-apply and fsts-rescore on a fixed set of observations for
+# every combination of thread counts and beams, and collects their throughput
+# reports (utterances/sec, real-time factor, latency percentiles, load time and
+# peak memory) into <bench-dir>/results.tsv.
+
+# Begin configuration section.
+thread_counts="1 4 16"
+prune_beams="8 12"
+steps_threshold=10
+utt2dur=
+# End configuration section.
+
+echo "$0 $@"  # Print the command line for logging
+
+. path.sh
+. parse_options.sh || exit 1;
+set -e
+
+if [ $# != 5 ]; then
+   echo "Usage: $0 [options] <decipher-dir> <lang-dir> <rescore-lang-dir> <input-scp> <bench-dir>"
+   echo ""
+   echo "main options (for others, see top of script file)"
+   echo "  --thread-counts <counts>                 # thread counts to benchmark (default: \"1 4 16\")"
+   echo "  --prune-beams <beams>                    # prune beams to benchmark (default: \"8 12\")"
+   echo "  --utt2dur <utt2dur>                      # utt2dur file for the real-time factor"
+   exit 1;
+fi
+
+decipher_dir=$1
+tgt_lang_dir=$2
+rescore_lang_dir=$3
+input_scp=$4
+dir=$5
+
+mkdir -p $dir/log
+
+utt2dur_opt=
+if [ ! -z $utt2dur ]; then
+  utt2dur_opt="ark,t:$utt2dur"
+fi
+
+phi=`awk '$1 == "#0" {print $2}' $tgt_lang_dir/words.txt`
+old_lm="fstmap --map_type=invert $tgt_lang_dir/G.fst |"
+new_lm="$rescore_lang_dir/G.fst"
+
+# Turns a "Throughput name value name value ..." log line into tab-separated values.
+parse_report() {
+  grep -o "Throughput .*" $1 | tail -n 1 | \
+    awk '{for (i = 3; i <= NF; i += 2) printf "\t%s", $i; printf "\n"}'
+}
+
+echo -e "stage\tthreads\tprune_beam\tutterances\tutterances_per_second\treal_time_factor\tlatency_p50\tlatency_p95\tlatency_p99\tload_time\tdecode_time\tpeak_rss_mb" > $dir/results.tsv
+
+for beam in $prune_beams; do
+  for threads in $thread_counts; do
+    name=apply.beam${beam}.threads${threads}
+    decipherment-apply \
+      --power=1 \
+      --prune_beam=$beam \
+      --steps-threshold=$steps_threshold \
+      --remove-weights=false \
+      --num_threads=$threads \
+      --utt2dur_rspecifier="$utt2dur_opt" \
+      $decipher_dir/{lex.word_final.smoothed.fst,ali.word_final.fst} $tgt_lang_dir/LG.fst \
+      "scp:$input_scp" ark,t:/dev/null "ark:$dir/fsts.beam${beam}.ark" 2> $dir/log/$name.log
+
+    echo -e "apply\t$threads\t$beam$(parse_report $dir/log/$name.log)" >> $dir/results.tsv
+  done
+
+  name=rescore.beam${beam}
+  fsts-rescore --phi-label=$phi --utt2dur-rspecifier="$utt2dur_opt" \
+    "ark:$dir/fsts.beam${beam}.ark" "$old_lm" "$new_lm" ark,t:/dev/null ark:/dev/null 2> $dir/log/$name.log
+
+  echo -e "rescore\t1\t$beam$(parse_report $dir/log/$name.log)" >> $dir/results.tsv
+  rm $dir/fsts.beam${beam}.ark
+done
+
+column -t $dir/results.tsv
@@ -11,6 +11,7 @@ num_restarts=50
 keep_top=20
 prune_beam=12
 steps_threshold=10
+curriculum=false
 # End configuration section.
 
 echo "$0 $@"  # Print the command line for logging
@@ -23,6 +24,7 @@ if [ $# != 3 ]; then
    echo "  --stage <stage>                          # stage"
    echo "  --num-threads <num-threads>              # number of threads"
    echo "  --num-restarts <num-restarts>            # number of random restarts"
+   echo "  --curriculum <true|false>                # run stages 2-5 in a single decipherment-learn"
    exit 1;
 fi
 
@@ -85,6 +87,34 @@ if [ $stage -le 1 ]; then
     awk '{print $1}' > $dir/random_restarts/best_init
 fi
 
+if $curriculum && [ $stage -le 2 ]; then
+  # Same stages as below, with observations loaded once and the lexical
+  # model pruned and smoothed in memory.
+  best_init=`cat $dir/random_restarts/best_init`
+  schedule="$tgt_lang_dir/lm.3gm.fst:20:standard:prune-top=$keep_top"
+  schedule="$schedule,$tgt_lang_dir/lm.4gm.fst:20:standard"
+  schedule="$schedule,$tgt_lang_dir/lm.5gm.fst:20:standard"
+  schedule="$schedule,$tgt_lang_dir/LG.fst:20:threeway:smooth=0.9"
+  mkdir -p $dir/checkpoint
+
+  time decipherment-learn \
+    --num-source-symbols=$num_src_syms \
+    --num-target-symbols=$num_tgt_syms \
+    --train-lex=true \
+    --train-ali=true \
+    --prune-beam=$prune_beam \
+    --steps-threshold=$steps_threshold \
+    --num-threads=$num_threads \
+    --schedule="$schedule" \
+    --smooth-output=0.9 \
+    --checkpoint-dir=$dir/checkpoint \
+    --resume=true \
+    $dir/random_restarts/{lex.stage1.${best_init}.fst,ali.stage1.${best_init}.fst} \
+    "$src_syms" $dir/{lex.word_final.smoothed.fst,ali.word_final.fst} || exit 1;
+
+  exit 0;
+fi
+
 if [ $stage -le 2 ]; then
   best_init=`cat $dir/random_restarts/best_init`
   fstprint $dir/random_restarts/lex.stage1.${best_init}.fst | \
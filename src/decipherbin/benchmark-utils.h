@@ -0,0 +1,130 @@
+#ifndef DECIPHERMENT_BENCHMARK_UTILS_H_
+#define DECIPHERMENT_BENCHMARK_UTILS_H_
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Peak resident set size of this process in megabytes, or -1 if
+// /proc/self/status is not available.
+inline double PeakRssMb() {
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, 6, "VmHWM:") == 0) {
+      std::istringstream is(line.substr(6));
+      double kb;
+      is >> kb;
+      return kb / 1024;
+    }
+  }
+  return -1;
+}
+
+// Hardware cache misses of the calling thread between Start and Stop, counted
+// with perf_event_open.  Stop returns -1 when the counter is not available,
+// e.g. in containers or with kernel.perf_event_paranoid > 2.
+class CacheMissCounter {
+
+  public:
+    CacheMissCounter() {
+      perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_CACHE_MISSES;
+      attr.disabled = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      fd_ = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    ~CacheMissCounter() {
+      if (fd_ >= 0) {
+        close(fd_);
+      }
+    }
+
+    void Start() {
+      if (fd_ >= 0) {
+        ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+      }
+    }
+
+    int64_t Stop() {
+      int64_t count;
+      if (fd_ < 0) {
+        return -1;
+      }
+      ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(fd_, &count, sizeof(count)) != sizeof(count)) {
+        return -1;
+      }
+      return count;
+    }
+
+  private:
+    int fd_;
+
+};
+
+// Collects per-utterance latencies of a decoding run and summarises them
+// together with throughput, real-time factor, model load time and peak memory.
+class ThroughputStats {
+
+  public:
+    ThroughputStats(): load_time_(0), audio_duration_(0) {}
+
+    void SetLoadTime(double seconds) {
+      load_time_ = seconds;
+    }
+
+    // Duration of the utterance audio in seconds, or 0 if unknown.
+    void AddUtterance(double latency, double duration) {
+      latencies_.push_back(latency);
+      audio_duration_ += duration;
+    }
+
+    double Percentile(double p) const {
+      if (latencies_.empty()) {
+        return 0;
+      }
+      std::vector<double> sorted(latencies_);
+      std::sort(sorted.begin(), sorted.end());
+      size_t index = std::min(sorted.size() - 1, static_cast<size_t>(p / 100 * sorted.size()));
+      return sorted[index];
+    }
+
+    // Single line of "name value" pairs for the given wall time of the
+    // decoding loop (excluding model loading).
+    std::string Report(double wall_time) const {
+      std::ostringstream os;
+      os << "utterances " << latencies_.size()
+         << " utterances-per-second " << (wall_time > 0 ? latencies_.size() / wall_time : 0)
+         << " real-time-factor " << (audio_duration_ > 0 ? wall_time / audio_duration_ : -1)
+         << " latency-p50 " << Percentile(50)
+         << " latency-p95 " << Percentile(95)
+         << " latency-p99 " << Percentile(99)
+         << " load-time " << load_time_
+         << " decode-time " << wall_time
+         << " peak-rss-mb " << PeakRssMb();
+      return os.str();
+    }
+
+  private:
+    double load_time_, audio_duration_;
+    std::vector<double> latencies_;
+
+};
+
+#endif  // DECIPHERMENT_BENCHMARK_UTILS_H_
@@ -0,0 +1,58 @@
+#ifndef DECIPHERMENT_BOUNDED_QUEUE_H_
+#define DECIPHERMENT_BOUNDED_QUEUE_H_
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+// Queue between producer and consumer threads.  Push blocks while the queue
+// holds capacity items, which must be at least 1, and returns false without
+// adding the item once the queue is closed, so that a producer can stop when
+// its consumer is gone.  Pop blocks until an item is available and returns
+// false once the queue is closed and drained.
+template <class T>
+class BoundedQueue {
+
+  public:
+    explicit BoundedQueue(size_t capacity): capacity_(capacity), closed_(false) {}
+
+    bool Push(T item) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      not_full_.wait(lock, [this] { return items_.size() < capacity_ || closed_; });
+      if (closed_) {
+        return false;
+      }
+      items_.push_back(std::move(item));
+      not_empty_.notify_one();
+      return true;
+    }
+
+    bool Pop(T *item) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      not_empty_.wait(lock, [this] { return !items_.empty() || closed_; });
+      if (items_.empty()) {
+        return false;
+      }
+      *item = std::move(items_.front());
+      items_.pop_front();
+      not_full_.notify_one();
+      return true;
+    }
+
+    void Close() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+      not_empty_.notify_all();
+      not_full_.notify_all();
+    }
+
+  private:
+    size_t capacity_;
+    bool closed_;
+    std::deque<T> items_;
+    std::mutex mutex_;
+    std::condition_variable not_empty_, not_full_;
+
+};
+
+#endif  // DECIPHERMENT_BOUNDED_QUEUE_H_
@@ -0,0 +1,219 @@
+#ifndef DECIPHERMENT_CHECKPOINT_H_
+#define DECIPHERMENT_CHECKPOINT_H_
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "base/kaldi-common.h"
+#include "util/kaldi-io.h"
+#include "fst/fstlib.h"
+#include "expectations.h"
+
+// Training state of decipherment-learn between iterations: the stage and
+// iteration to continue from, the likelihood of every finished iteration, and
+// the lex and ali models to continue with.
+struct TrainingCheckpoint {
+  struct Entry {
+    int stage;
+    int iter;
+    double likelihood;
+  };
+
+  int stage;
+  int iter;
+  std::vector<Entry> history;
+
+  TrainingCheckpoint(): stage(0), iter(0) {}
+};
+
+namespace checkpoint_internal {
+
+inline std::string ModelFilename(const std::string &dir, const std::string &name, int stage, int iter) {
+  return dir + "/" + name + "." + std::to_string(stage) + "." + std::to_string(iter) + ".fst";
+}
+
+inline void Rename(const std::string &from, const std::string &to) {
+  if (std::rename(from.c_str(), to.c_str()) != 0) {
+    KALDI_ERR << "Could not rename " << from << " to " << to;
+  }
+}
+
+}  // namespace checkpoint_internal
+
+// Writes the models under names containing the stage and iteration, then
+// replaces <dir>/checkpoint, which names them, and only then removes the
+// models of the previous checkpoint.  Every file is written to a temporary
+// name first and renamed, so a checkpoint is either complete or not there.
+template <class Arc>
+void WriteTrainingCheckpoint(
+    const std::string &dir, const TrainingCheckpoint &checkpoint,
+    const fst::VectorFst<Arc> &lex_fst, const fst::VectorFst<Arc> &ali_fst
+) {
+  using namespace checkpoint_internal;
+  TrainingCheckpoint previous;
+  bool has_previous = false;
+  std::ifstream previous_is(dir + "/checkpoint");
+  if (previous_is.good()) {
+    previous_is >> previous.stage >> previous.iter;
+    has_previous = !previous_is.fail();
+  }
+
+  std::string lex_filename = ModelFilename(dir, "lex", checkpoint.stage, checkpoint.iter),
+      ali_filename = ModelFilename(dir, "ali", checkpoint.stage, checkpoint.iter);
+  fst::StdVectorFst std_fst;
+  fst::Cast(lex_fst, &std_fst);
+  if (!std_fst.Write(lex_filename + ".tmp")) {
+    KALDI_ERR << "Could not write " << lex_filename;
+  }
+  fst::Cast(ali_fst, &std_fst);
+  if (!std_fst.Write(ali_filename + ".tmp")) {
+    KALDI_ERR << "Could not write " << ali_filename;
+  }
+  Rename(lex_filename + ".tmp", lex_filename);
+  Rename(ali_filename + ".tmp", ali_filename);
+
+  {
+    std::ofstream os(dir + "/checkpoint.tmp");
+    os << checkpoint.stage << " " << checkpoint.iter << "\n";
+    os.precision(10);
+    for (const auto &entry: checkpoint.history) {
+      os << entry.stage << " " << entry.iter << " " << entry.likelihood << "\n";
+    }
+    os.close();
+    if (os.fail()) {
+      KALDI_ERR << "Could not write " << dir << "/checkpoint.tmp";
+    }
+  }
+  Rename(dir + "/checkpoint.tmp", dir + "/checkpoint");
+
+  if (has_previous && (previous.stage != checkpoint.stage || previous.iter != checkpoint.iter)) {
+    std::remove(ModelFilename(dir, "lex", previous.stage, previous.iter).c_str());
+    std::remove(ModelFilename(dir, "ali", previous.stage, previous.iter).c_str());
+  }
+}
+
+// Returns false if there is no checkpoint in dir.
+template <class Arc>
+bool ReadTrainingCheckpoint(
+    const std::string &dir, TrainingCheckpoint *checkpoint,
+    fst::VectorFst<Arc> *lex_fst, fst::VectorFst<Arc> *ali_fst
+) {
+  using namespace checkpoint_internal;
+  std::ifstream is(dir + "/checkpoint");
+  if (!is.good()) {
+    return false;
+  }
+
+  *checkpoint = TrainingCheckpoint();
+  if (!(is >> checkpoint->stage >> checkpoint->iter)) {
+    KALDI_ERR << "Could not read " << dir << "/checkpoint";
+  }
+  TrainingCheckpoint::Entry entry;
+  while (is >> entry.stage >> entry.iter >> entry.likelihood) {
+    checkpoint->history.push_back(entry);
+  }
+
+  std::string lex_filename = ModelFilename(dir, "lex", checkpoint->stage, checkpoint->iter),
+      ali_filename = ModelFilename(dir, "ali", checkpoint->stage, checkpoint->iter);
+  fst::StdVectorFst *std_lex_fst = fst::StdVectorFst::Read(lex_filename);
+  fst::StdVectorFst *std_ali_fst = fst::StdVectorFst::Read(ali_filename);
+  if (std_lex_fst == NULL || std_ali_fst == NULL) {
+    KALDI_ERR << "Could not read models of checkpoint in " << dir;
+  }
+  fst::Cast(*std_lex_fst, lex_fst);
+  fst::Cast(*std_ali_fst, ali_fst);
+  delete std_lex_fst;
+  delete std_ali_fst;
+  return true;
+}
+
+// Expectations accumulated over the first num_tasks tasks, of task_size
+// observations each, of an iteration, in <dir>/accumulator.
+template <class Arc>
+void WriteAccumulatorCheckpoint(
+    const std::string &dir, int stage, int iter, int num_tasks, int task_size,
+    const Expectations<Arc> &expectations
+) {
+  std::string filename = dir + "/accumulator";
+  {
+    kaldi::Output ko(filename + ".tmp", true);
+    kaldi::WriteToken(ko.Stream(), true, "<AccumulatorCheckpoint>");
+    kaldi::WriteBasicType(ko.Stream(), true, stage);
+    kaldi::WriteBasicType(ko.Stream(), true, iter);
+    kaldi::WriteBasicType(ko.Stream(), true, num_tasks);
+    kaldi::WriteBasicType(ko.Stream(), true, task_size);
+    expectations.Write(ko.Stream(), true);
+    if (!ko.Close()) {
+      KALDI_ERR << "Could not write " << filename << ".tmp";
+    }
+  }
+  checkpoint_internal::Rename(filename + ".tmp", filename);
+}
+
+// Returns false if there is no accumulator for this stage, iteration and
+// task size.
+template <class Arc>
+bool ReadAccumulatorCheckpoint(
+    const std::string &dir, int stage, int iter, int task_size,
+    int *num_tasks, Expectations<Arc> *expectations
+) {
+  std::string filename = dir + "/accumulator";
+  if (!std::ifstream(filename).good()) {
+    return false;
+  }
+
+  bool binary;
+  kaldi::Input ki(filename, &binary);
+  int checkpoint_stage, checkpoint_iter, checkpoint_task_size;
+  kaldi::ExpectToken(ki.Stream(), binary, "<AccumulatorCheckpoint>");
+  kaldi::ReadBasicType(ki.Stream(), binary, &checkpoint_stage);
+  kaldi::ReadBasicType(ki.Stream(), binary, &checkpoint_iter);
+  kaldi::ReadBasicType(ki.Stream(), binary, num_tasks);
+  kaldi::ReadBasicType(ki.Stream(), binary, &checkpoint_task_size);
+  if (checkpoint_stage != stage || checkpoint_iter != iter || checkpoint_task_size != task_size) {
+    return false;
+  }
+
+  expectations->Read(ki.Stream(), binary);
+  return true;
+}
+
+inline void RemoveAccumulatorCheckpoint(const std::string &dir) {
+  std::remove((dir + "/accumulator").c_str());
+}
+
+// Running statistics of online EM: the number of updates they have been
+// through, which sets the size of the next step, and the expectations per
+// observation.
+template <class Arc>
+void WriteOnlineStats(const std::string &filename, int num_updates, const Expectations<Arc> &expectations) {
+  {
+    kaldi::Output ko(filename + ".tmp", true);
+    kaldi::WriteToken(ko.Stream(), true, "<OnlineStats>");
+    kaldi::WriteBasicType(ko.Stream(), true, num_updates);
+    expectations.Write(ko.Stream(), true);
+    if (!ko.Close()) {
+      KALDI_ERR << "Could not write " << filename << ".tmp";
+    }
+  }
+  checkpoint_internal::Rename(filename + ".tmp", filename);
+}
+
+// Returns false if there are no statistics in filename.
+template <class Arc>
+bool ReadOnlineStats(const std::string &filename, int *num_updates, Expectations<Arc> *expectations) {
+  if (!std::ifstream(filename).good()) {
+    return false;
+  }
+
+  bool binary;
+  kaldi::Input ki(filename, &binary);
+  kaldi::ExpectToken(ki.Stream(), binary, "<OnlineStats>");
+  kaldi::ReadBasicType(ki.Stream(), binary, num_updates);
+  expectations->Read(ki.Stream(), binary);
+  return true;
+}
+
+#endif  // DECIPHERMENT_CHECKPOINT_H_
@@ -0,0 +1,104 @@
+#ifndef DECIPHERMENT_CHUNKING_H_
+#define DECIPHERMENT_CHUNKING_H_
+
+#include <cmath>
+#include <vector>
+
+#include "fst/fstlib.h"
+
+// Collects the states of a layered observation, i.e. one where all arcs of
+// the i-th state lead to the (i+1)-th state and only the last state is final.
+// Linear acceptors from transcripts-to-fsts and sausages from
+// lattices-to-phone-fsts both have this shape.
+template <class Arc>
+bool GetObservationSlots(const fst::VectorFst<Arc> &ifst, std::vector<typename Arc::StateId> *states) {
+  using StateId = typename Arc::StateId;
+  using Weight = typename Arc::Weight;
+
+  states->clear();
+  StateId state = ifst.Start();
+  while (state != fst::kNoStateId && states->size() <= ifst.NumStates()) {
+    states->push_back(state);
+    if (ifst.NumArcs(state) == 0) {
+      return ifst.Final(state) != Weight::Zero();
+    }
+
+    if (ifst.Final(state) != Weight::Zero()) {
+      return false;
+    }
+
+    StateId nextstate = fst::kNoStateId;
+    for (fst::ArcIterator<fst::VectorFst<Arc>> aiter(ifst, state); !aiter.Done(); aiter.Next()) {
+      const Arc &arc = aiter.Value();
+      if (nextstate != fst::kNoStateId && arc.nextstate != nextstate) {
+        return false;
+      }
+      nextstate = arc.nextstate;
+    }
+
+    if (nextstate == state) {
+      return false;
+    }
+    state = nextstate;
+  }
+
+  return false;
+}
+
+// Splits a layered observation after every slot in which the silence label
+// (1) has posterior of at least silence_threshold, as long as the chunk is at
+// least min_chunk_length slots long.  Returns false and the observation itself
+// as a single chunk when it is not layered.
+template <class Arc>
+bool SplitObservationAtSilence(
+    const fst::VectorFst<Arc> &ifst, float silence_threshold, int min_chunk_length,
+    std::vector<fst::VectorFst<Arc>> *chunks
+) {
+  using StateId = typename Arc::StateId;
+  using Weight = typename Arc::Weight;
+
+  chunks->clear();
+  std::vector<StateId> states;
+  if (!GetObservationSlots(ifst, &states) || states.size() < 2) {
+    chunks->push_back(ifst);
+    return false;
+  }
+
+  size_t num_slots = states.size() - 1;
+  size_t begin = 0;
+  for (size_t slot = 0; slot < num_slots; slot++) {
+    float silence_posterior = 0;
+    for (fst::ArcIterator<fst::VectorFst<Arc>> aiter(ifst, states[slot]); !aiter.Done(); aiter.Next()) {
+      const Arc &arc = aiter.Value();
+      if (arc.ilabel == 1) {
+        silence_posterior += exp(-arc.weight.Value());
+      }
+    }
+
+    bool is_last_slot = slot + 1 == num_slots;
+    bool is_boundary = silence_posterior >= silence_threshold && slot + 1 - begin >= min_chunk_length;
+    if (!is_last_slot && !is_boundary) {
+      continue;
+    }
+
+    fst::VectorFst<Arc> chunk;
+    chunk.AddState();
+    chunk.SetStart(0);
+    for (size_t i = begin; i <= slot; i++) {
+      StateId nextstate = chunk.AddState();
+      for (fst::ArcIterator<fst::VectorFst<Arc>> aiter(ifst, states[i]); !aiter.Done(); aiter.Next()) {
+        Arc arc = aiter.Value();
+        arc.nextstate = nextstate;
+        chunk.AddArc(nextstate - 1, arc);
+      }
+    }
+    chunk.SetFinal(chunk.NumStates() - 1, is_last_slot ? ifst.Final(states[num_slots]) : Weight::One());
+
+    chunks->push_back(chunk);
+    begin = slot + 1;
+  }
+
+  return true;
+}
+
+#endif  // DECIPHERMENT_CHUNKING_H_
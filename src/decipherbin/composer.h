@@ -1,14 +1,24 @@
 #ifndef DECIPHERMENT_COMPOSER_H_
 #define DECIPHERMENT_COMPOSER_H_
 
+#include <memory>
+
+#include "base/timer.h"
 #include "threeway_compose.h"
+#include "decipherment-stats.h"
+#include "state-order.h"
 
+// Result of a composer, also used as the workspace of the next composition:
+// a thread that keeps one Composition for all of its observations reuses its
+// buffers instead of allocating new ones every time.
 template <class Arc>
 struct Composition {
 
   fst::VectorFst<Arc> fst;
   std::vector<typename Arc::StateId> lex_state;
   std::vector<typename Arc::StateId> ali_state;
+  DeciphermentStats stats;
+  std::unique_ptr<fst::ThreeWayComposition<Arc>> threeway;
 
 };
 
@@ -16,7 +26,8 @@ template <class Arc>
 class Composer {
 
   public:
-    virtual Composition<Arc>* Compose(const fst::VectorFst<Arc> &ifst) const = 0;
+    // Replaces composition by the composition of ifst with the models.
+    virtual void Compose(const fst::VectorFst<Arc> &ifst, Composition<Arc> *composition) const = 0;
     virtual ~Composer() { };
 
 };
@@ -32,11 +43,21 @@ class StandardComposer: public Composer<Arc> {
     using StateTable = typename fst::GenericComposeStateTable<Arc, fst::IntegerFilterState<signed char>>;
     using StateId = typename Arc::StateId;
 
-    StandardComposer(const Fst &lex_fst, const Fst &ali_fst, const Fst &lm_fst) {
-      Fst la_fst;
-      state_table_la_ = Compose(lex_fst, ali_fst, &la_fst);
-      state_table_lag_ = Compose(la_fst, lm_fst, &lag_fst_);
-      fst::ArcSort(&lag_fst_, fst::ILabelCompare<Arc>());
+    // With lazy_lm, lex∘ali∘LM is not built.  Every observation is composed
+    // with lex∘ali and the result with the LM instead, so that only the LM
+    // states the observation reaches are expanded, at the cost of composing
+    // with the LM again for every observation.
+    StandardComposer(const Fst &lex_fst, const Fst &ali_fst, const Fst &lm_fst, bool lazy_lm = false)
+        : lazy_lm_(lazy_lm), state_table_lag_(NULL) {
+      state_table_la_ = Compose(lex_fst, ali_fst, &la_fst_);
+      if (lazy_lm_) {
+        fst::ArcSort(&la_fst_, fst::ILabelCompare<Arc>());
+        lm_fst_ = lm_fst;
+      } else {
+        state_table_lag_ = Compose(la_fst_, lm_fst, &lag_fst_);
+        fst::ArcSort(&lag_fst_, fst::ILabelCompare<Arc>());
+        la_fst_.DeleteStates();
+      }
     }
 
     ~StandardComposer() {
@@ -44,9 +65,17 @@ class StandardComposer: public Composer<Arc> {
       delete state_table_lag_;
     }
 
-    Composition<Arc>* Compose(const Fst &ifst) const {
-      Composition<Arc> *composition = new Composition<Arc>();
+    void Compose(const Fst &ifst, Composition<Arc> *composition) const {
+      if (lazy_lm_) {
+        ComposeLazyLm(ifst, composition);
+        return;
+      }
+
+      kaldi::Timer timer;
+      composition->stats = DeciphermentStats();
       StateTable *state_table = Compose(ifst, lag_fst_, &(composition->fst));
+      composition->stats.states_expanded = composition->fst.NumStates();
+      composition->stats.arcs_added = fst::NumArcs(composition->fst);
 
       composition->lex_state.resize(composition->fst.NumStates());
       composition->ali_state.resize(composition->fst.NumStates());
@@ -61,11 +90,37 @@ class StandardComposer: public Composer<Arc> {
       }
 
       delete state_table;
-      return composition;
+      composition->stats.compose_time = timer.Elapsed();
     }
 
   private:
 
+    void ComposeLazyLm(const Fst &ifst, Composition<Arc> *composition) const {
+      kaldi::Timer timer;
+      composition->stats = DeciphermentStats();
+      Fst ila_fst;
+      StateTable *state_table_ila = Compose(ifst, la_fst_, &ila_fst);
+      StateTable *state_table = Compose(ila_fst, lm_fst_, &(composition->fst));
+      composition->stats.states_expanded = composition->fst.NumStates();
+      composition->stats.arcs_added = fst::NumArcs(composition->fst);
+
+      composition->lex_state.resize(composition->fst.NumStates());
+      composition->ali_state.resize(composition->fst.NumStates());
+
+      for (fst::StateIterator<Fst> siter(composition->fst); !siter.Done(); siter.Next()) {
+        StateId state = siter.Value();
+        StateId ila_state = state_table->Tuple(state).StateId1();
+        StateId la_state = state_table_ila->Tuple(ila_state).StateId2();
+
+        composition->lex_state[state] = state_table_la_->Tuple(la_state).StateId1();
+        composition->ali_state[state] = state_table_la_->Tuple(la_state).StateId2();
+      }
+
+      delete state_table_ila;
+      delete state_table;
+      composition->stats.compose_time = timer.Elapsed();
+    }
+
     StateTable* Compose(const Fst &fst1, const Fst &fst2, Fst *ofst) const {
       ComposeFstOptions opts;
       opts.gc_limit = 0;
@@ -75,7 +130,8 @@ class StandardComposer: public Composer<Arc> {
       return opts.state_table;
     }
 
-    Fst lag_fst_;
+    bool lazy_lm_;
+    Fst la_fst_, lm_fst_, lag_fst_;
     StateTable *state_table_la_, *state_table_lag_;
 
 };
@@ -86,36 +142,75 @@ class ThreewayComposer: public Composer<Arc> {
 
   public:
     using Fst = typename fst::VectorFst<Arc>;
-    using ComposeFst = typename fst::ComposeFst<fst::StdArc>;
-    using SM = typename fst::SortedMatcher<fst::Fst<fst::StdArc>>;
+    using ComposeFst = typename fst::ComposeFst<Arc>;
+    using SM = typename fst::SortedMatcher<fst::Fst<Arc>>;
     using ComposeFstOptions = typename fst::ComposeFstImplOptions<SM, SM>;
-    using StateTable = typename fst::GenericComposeStateTable<fst::StdArc, fst::IntegerFilterState<signed char>>;
-    using ThreewayStateTable = typename fst::ThreeWayComposeStateTable<fst::StdArc>;
+    using StateTable = typename fst::GenericComposeStateTable<Arc, fst::IntegerFilterState<signed char>>;
+    using ThreewayStateTable = typename fst::ThreeWayComposeStateTable<Arc>;
+    using ThreeWayComposition = typename fst::ThreeWayComposition<Arc>;
     using StateId = typename Arc::StateId;
 
+    // With max_paths == 1 the search stops once the best final state is
+    // known, which is enough for Viterbi training.  With sort_states, the
+    // states of lex∘ali are renumbered breadth-first before its DenseMatcher
+    // is built (see state-order.h).  lm_potentials, if not NULL, are the
+    // lookahead potentials of the LM states (see ComputeLookaheadPotentials).
     ThreewayComposer(
-        const Fst &log_lex_fst, const Fst &log_ali_fst, const Fst &log_lm_fst,
-        float prune_beam, int steps_threshold
-    ): prune_beam_(prune_beam), steps_threshold_(steps_threshold) {
-      fst::StdVectorFst lex_fst, ali_fst;
-      fst::Cast(log_lex_fst, &lex_fst);
-      fst::Cast(log_ali_fst, &ali_fst);
-      fst::Cast(log_lm_fst, &lm_fst_);
-      state_table_la_ = Compose(lex_fst, ali_fst, &la_fst_);
+        const Fst &lex_fst, const Fst &ali_fst, const Fst &lm_fst,
+        float prune_beam, int steps_threshold, int max_paths = -1, bool sort_states = false,
+        const std::vector<float> *lm_potentials = NULL
+    ): prune_beam_(prune_beam), steps_threshold_(steps_threshold), max_paths_(max_paths),
+       retry_prune_beam_(0), retry_min_states_(0), lm_fst_(lm_fst), lm_potentials_(lm_potentials) {
+      StateTable *state_table_la = Compose(lex_fst, ali_fst, &la_fst_);
+      std::vector<StateId> order;
+      if (sort_states) {
+        SortStatesBreadthFirst(&la_fst_, &order);
+      }
+
+      la_lex_state_.resize(la_fst_.NumStates());
+      la_ali_state_.resize(la_fst_.NumStates());
+      for (StateId state = 0; state < la_fst_.NumStates(); state++) {
+        StateId la_state = order.empty() ? state : order[state];
+        la_lex_state_[la_state] = state_table_la->Tuple(state).StateId1();
+        la_ali_state_[la_state] = state_table_la->Tuple(state).StateId2();
+      }
+      delete state_table_la;
+
+      la_matcher_.reset(new fst::DenseMatcher<Arc>(la_fst_));
     }
 
-    ~ThreewayComposer() {
-      delete state_table_la_;
+    // Composes an observation again with retry_prune_beam when no final
+    // state was reached or the composition has fewer than min_states states.
+    void SetRetry(float retry_prune_beam, int min_states) {
+      retry_prune_beam_ = retry_prune_beam;
+      retry_min_states_ = min_states;
     }
 
-    Composition<Arc>* Compose(const Fst &log_ifst) const {
-      fst::StdVectorFst ifst;
-      fst::Cast(log_ifst, &ifst);
-      fst::ThreeWayComposition<fst::StdArc> tc(ifst, la_fst_, lm_fst_, steps_threshold_, prune_beam_, -1);
+    void Compose(const Fst &ifst, Composition<Arc> *composition) const {
+      kaldi::Timer timer;
+      if (composition->threeway == nullptr) {
+        composition->threeway.reset(new ThreeWayComposition());
+      }
+      ThreeWayComposition &tc = *composition->threeway;
+      fst::ThreeWayComposeOptions opts(steps_threshold_, prune_beam_, max_paths_);
+      opts.potentials3 = lm_potentials_;
+      tc.Compose(ifst, la_fst_, lm_fst_, *la_matcher_, opts);
+
+      DeciphermentStats retry_stats;
+      bool is_too_small = tc.GetBestFinalTuple().StateId1() == fst::kNoStateId || tc.GetFst().NumStates() < retry_min_states_;
+      if (retry_prune_beam_ > prune_beam_ && is_too_small) {
+        retry_stats = tc.GetStats();
+        retry_stats.compose_retries = 1;
+        opts.prune_beam = retry_prune_beam_;
+        tc.Compose(ifst, la_fst_, lm_fst_, *la_matcher_, opts);
+      }
 
-      Composition<Arc> *composition = new Composition<Arc>();
-      fst::Cast(tc.GetFst(), &composition->fst);
-      ThreewayStateTable state_table = tc.GetStateTable();
+      // Shares the composition's fst, which the next composition replaces
+      // rather than overwrites.
+      composition->fst = tc.GetFst();
+      composition->stats = tc.GetStats();
+      composition->stats.Add(retry_stats);
+      const ThreewayStateTable &state_table = tc.GetStateTable();
 
       composition->lex_state.resize(composition->fst.NumStates());
       composition->ali_state.resize(composition->fst.NumStates());
@@ -124,16 +219,16 @@ class ThreewayComposer: public Composer<Arc> {
         StateId state = siter.Value();
         StateId la_state = state_table.Tuple(state).StateId2();
 
-        composition->lex_state[state] = state_table_la_->Tuple(la_state).StateId1();
-        composition->ali_state[state] = state_table_la_->Tuple(la_state).StateId2();
+        composition->lex_state[state] = la_lex_state_[la_state];
+        composition->ali_state[state] = la_ali_state_[la_state];
       }
 
-      return composition;
+      composition->stats.compose_time = timer.Elapsed();
     }
 
   private:
 
-    StateTable* Compose(const fst::StdVectorFst &fst1, const fst::StdVectorFst &fst2, fst::StdVectorFst *ofst) const {
+    StateTable* Compose(const Fst &fst1, const Fst &fst2, Fst *ofst) const {
       ComposeFstOptions opts;
       opts.gc_limit = 0;
       opts.own_state_table = false;
@@ -144,8 +239,14 @@ class ThreewayComposer: public Composer<Arc> {
 
     float prune_beam_;
     int steps_threshold_;
-    fst::StdVectorFst la_fst_, lm_fst_;
-    StateTable *state_table_la_;
+    int max_paths_;
+    float retry_prune_beam_;
+    int retry_min_states_;
+    Fst la_fst_, lm_fst_;
+    const std::vector<float> *lm_potentials_;
+    std::unique_ptr<fst::DenseMatcher<Arc>> la_matcher_;
+    // Lex and ali state of every state of la_fst_.
+    std::vector<StateId> la_lex_state_, la_ali_state_;
 };
 
 #endif  // DECIPHERMENT_COMPOSER_H_
@@ -1,8 +1,209 @@
+#include <thread>
+
 #include "base/kaldi-common.h"
 #include "util/common-utils.h"
+#include "lat/kaldi-lattice.h"
+#include "lat/lattice-functions.h"
 #include "fstext/fstext-utils.h"
 #include "fstext/kaldi-fst-io.h"
-#include "threeway_compose.h"
+#include "util/kaldi-thread.h"
+#include "decoder.h"
+#include "chunking.h"
+#include "benchmark-utils.h"
+#include "object-pool.h"
+#include "bounded-queue.h"
+#include "phone-sausage.h"
+
+
+struct SourceObservation {
+  std::string key;
+  fst::StdVectorFst fst;
+};
+
+// Reads the observations, or lattices turned into sausage fsts by MBR, on a
+// thread of its own and passes them on through a queue, so that MBR of the
+// next lattices overlaps with deciphering earlier ones.  The queue is closed
+// at the end of the input or on an error, which Error() then returns.
+class ObservationReader {
+  public:
+    ObservationReader(
+        const std::string &rspecifier, bool lattice_input, kaldi::BaseFloat acoustic_scale, kaldi::BaseFloat lm_scale,
+        const kaldi::MinimumBayesRiskOptions &mbr_opts, const PhoneSausageOptions &sausage_opts,
+        size_t queue_size
+    ): observations_(queue_size) {
+      thread_ = std::thread([this, rspecifier, lattice_input, acoustic_scale, lm_scale, mbr_opts, sausage_opts] {
+        try {
+          if (lattice_input) {
+            std::vector<std::vector<double> > scale = fst::LatticeScale(lm_scale, acoustic_scale);
+            kaldi::SequentialCompactLatticeReader clat_reader(rspecifier);
+            for (; !clat_reader.Done(); clat_reader.Next()) {
+              SourceObservation observation;
+              observation.key = clat_reader.Key();
+              LatticeToSausageFst(scale, mbr_opts, sausage_opts, &clat_reader.Value(), &observation.fst);
+              if (!observations_.Push(std::move(observation))) {
+                break;
+              }
+            }
+          } else {
+            kaldi::SequentialTableReader<fst::VectorFstHolder> source_reader(rspecifier);
+            for (; !source_reader.Done(); source_reader.Next()) {
+              SourceObservation observation;
+              observation.key = source_reader.Key();
+              observation.fst = source_reader.Value();
+              if (!observations_.Push(std::move(observation))) {
+                break;
+              }
+            }
+          }
+        } catch (const std::exception &e) {
+          error_ = e.what();
+        }
+        observations_.Close();
+      });
+    }
+
+    ~ObservationReader() {
+      observations_.Close();
+      thread_.join();
+    }
+
+    bool Next(SourceObservation *observation) {
+      return observations_.Pop(observation);
+    }
+
+    // Valid once Next has returned false.
+    const std::string &Error() const {
+      return error_;
+    }
+
+  private:
+    BoundedQueue<SourceObservation> observations_;
+    std::string error_;
+    std::thread thread_;
+};
+
+struct DecipheredUtterance {
+  std::string key;
+  fst::StdVectorFst fst;
+  // Used instead of fst with separable scores.
+  kaldi::Lattice lattice;
+  bool empty;
+  DeciphermentStats stats;
+  // Started when the utterance is read, so that its latency includes queueing.
+  kaldi::Timer timer;
+  double duration;
+
+  DecipheredUtterance(const std::string &key, double duration): key(key), empty(false), duration(duration) {}
+};
+
+// Deciphers a sequence of chunks of one utterance and appends the result to
+// the utterance in the order the tasks were started.  When LM state carries
+// over, all chunks are deciphered by one task.
+class DecipherTask {
+  public:
+    typedef kaldi::TableWriter<kaldi::BasicVectorHolder<double>> ProfileWriter;
+    typedef ObjectPool<fst::ThreeWayComposition<fst::StdArc>> WorkspacePool;
+    typedef ObjectPool<fst::ThreeWayComposition<kaldi::LatticeArc>> LatticeWorkspacePool;
+
+    DecipherTask(
+        const DecipherOptions *opts,
+        const DeciphermentModel *model,
+        const std::vector<fst::StdVectorFst> &chunks,
+        DecipheredUtterance *utterance,
+        bool is_last_task,
+        kaldi::Int32VectorWriter *target_writer,
+        kaldi::TableWriter<fst::VectorFstHolder> *fst_writer,
+        kaldi::LatticeWriter *lattice_writer,
+        ProfileWriter *profile_writer,
+        DeciphermentStats *total_stats,
+        ThroughputStats *throughput_stats,
+        WorkspacePool *workspaces,
+        LatticeWorkspacePool *lattice_workspaces
+    ): opts_(opts), model_(model), chunks_(chunks), utterance_(utterance),
+       is_last_task_(is_last_task), target_writer_(target_writer), fst_writer_(fst_writer),
+       lattice_writer_(lattice_writer), profile_writer_(profile_writer), total_stats_(total_stats),
+       throughput_stats_(throughput_stats), workspaces_(workspaces), lattice_workspaces_(lattice_workspaces),
+       empty_(false) { }
+
+  void operator() () {
+    if (lattice_writer_ != NULL) {
+      std::unique_ptr<fst::ThreeWayComposition<kaldi::LatticeArc>> workspace = lattice_workspaces_->Acquire();
+      empty_ = !DecipherChunks(*model_, chunks_, *opts_, &deciphered_lattice_, &stats_, workspace.get());
+      lattice_workspaces_->Release(std::move(workspace));
+    } else {
+      std::unique_ptr<fst::ThreeWayComposition<fst::StdArc>> workspace = workspaces_->Acquire();
+      empty_ = !DecipherChunks(*model_, chunks_, *opts_, &deciphered_fst_, &stats_, workspace.get());
+      workspaces_->Release(std::move(workspace));
+    }
+  }
+
+  ~DecipherTask() {
+    utterance_->stats.Add(stats_);
+    if (empty_ || utterance_->empty) {
+      utterance_->empty = true;
+    } else if (lattice_writer_ != NULL) {
+      if (utterance_->lattice.Start() == fst::kNoStateId) {
+        utterance_->lattice = deciphered_lattice_;
+      } else {
+        fst::Concat(&utterance_->lattice, deciphered_lattice_);
+      }
+    } else if (utterance_->fst.Start() == fst::kNoStateId) {
+      utterance_->fst = deciphered_fst_;
+    } else {
+      fst::Concat(&utterance_->fst, deciphered_fst_);
+    }
+
+    if (is_last_task_) {
+      Write();
+      throughput_stats_->AddUtterance(utterance_->timer.Elapsed(), utterance_->duration);
+      total_stats_->Add(utterance_->stats);
+      if (profile_writer_ != NULL) {
+        profile_writer_->Write(utterance_->key, utterance_->stats.ToVector());
+      }
+      delete utterance_;
+    }
+  }
+
+ private:
+  void Write() {
+    const std::string &key = utterance_->key;
+    std::vector<kaldi::int32> tgt_sequence;
+    fst::StdVectorFst output_fst;
+    if (lattice_writer_ != NULL && !utterance_->empty) {
+      fst::ArcMap(utterance_->lattice, &utterance_->fst, LatticeToStdMapper());
+    }
+    if (!utterance_->empty && MakeDecipherOutput(*opts_, &utterance_->fst, &tgt_sequence, &output_fst)) {
+      target_writer_->Write(key, tgt_sequence);
+      fst_writer_->Write(key, output_fst);
+      if (lattice_writer_ != NULL) {
+        MakeSeparableLattice(model_->Power(), opts_->prune_output ? opts_->output_prune_beam : -1, &utterance_->lattice);
+        lattice_writer_->Write(key, utterance_->lattice);
+      }
+      KALDI_LOG << key << " processed with fst " << output_fst.NumStates() << " states and " << fst::NumArcs(output_fst) << " arcs";
+    } else {
+      KALDI_LOG << key << " is empty";
+    }
+  }
+
+  const DecipherOptions *opts_;
+  const DeciphermentModel *model_;
+  std::vector<fst::StdVectorFst> chunks_;
+  DecipheredUtterance *utterance_;
+  bool is_last_task_;
+  kaldi::Int32VectorWriter *target_writer_;
+  kaldi::TableWriter<fst::VectorFstHolder> *fst_writer_;
+  kaldi::LatticeWriter *lattice_writer_;
+  ProfileWriter *profile_writer_;
+  DeciphermentStats *total_stats_;
+  ThroughputStats *throughput_stats_;
+  WorkspacePool *workspaces_;
+  LatticeWorkspacePool *lattice_workspaces_;
+  DeciphermentStats stats_;
+  fst::StdVectorFst deciphered_fst_;
+  kaldi::Lattice deciphered_lattice_;
+  bool empty_;
+
+};
 
 
 int main(int argc, char *argv[]) {
@@ -16,22 +217,64 @@ int main(int argc, char *argv[]) {
 
     const char *usage =
         "Usage:\n"
-        " decipherment-apply <lex-filename> <ali-filename> <lm-filename> <source-rspecifier> <target-wspecifier>\n";
+        " decipherment-apply <lex-filename> <ali-filename> <lm-filename> <source-rspecifier> <target-wspecifier> <fst-wspecifier>\n"
+        "With --lattice_input, <source-rspecifier> holds phone lattices, which are turned into\n"
+        "sausage fsts as by lattices-to-phone-fsts.\n"
+        "With --separable_lattice_wspecifier, the search keeps the lex cost apart from the others and\n"
+        "also writes lattices whose weights hold the alignment, LM and observation costs as graph cost\n"
+        "and the unscaled lex cost as acoustic cost, for lattice-power-sweep.\n";
 
     float power = 2.5;
+    DeciphermentModelOptions model_opts;
     float prune_beam = 8;
     float output_prune_beam = 4;
     int steps_threshold = 5;
     bool prune_output = true;
     bool remove_weights = true;
+    int num_threads = 1;
+    float chunk_silence_threshold = 0;
+    int chunk_min_length = 20;
+    bool chunk_carry_state = false;
+    int compose_threads = 1;
+    std::string profile_wspecifier;
+    std::string utt2dur_rspecifier;
+    bool lattice_input = false;
+    BaseFloat acoustic_scale = 0.1;
+    BaseFloat lm_scale = 1.0;
+    int lattice_queue_size = 16;
+    std::string separable_lattice_wspecifier;
 
     ParseOptions po(usage);
     po.Register("power", &power, "Power p for P(S|T)^p");
+    po.Register("sort_states", &model_opts.sort_states, "Renumber the states of lex∘ali and the LM breadth-first for memory locality");
+    po.Register("push_lm", &model_opts.push_lm, "Push LM weights towards the start state");
+    po.Register("lm_lookahead", &model_opts.lm_lookahead, "Add the best LM cost to a final state to the search priorities, "
+                "which allows a tighter prune_beam");
     po.Register("prune_beam", &prune_beam, "Prune beam");
     po.Register("output_prune_beam", &output_prune_beam, "Output prune beam");
     po.Register("steps_threshold", &steps_threshold, "Steps threshold");
     po.Register("prune_output", &prune_output, "Prune output");
     po.Register("remove_weights", &remove_weights, "Remove weights");
+    po.Register("num_threads", &num_threads, "Number of threads");
+    po.Register("chunk_silence_threshold", &chunk_silence_threshold, "If >0, split observations after slots with silence posterior above this threshold");
+    po.Register("chunk_min_length", &chunk_min_length, "Minimum number of slots in a chunk");
+    po.Register("chunk_carry_state", &chunk_carry_state, "Start each chunk from the LM state of the previous chunk's best path (chunks are then processed sequentially)");
+    po.Register("compose_threads", &compose_threads, "Number of threads expanding each observation position within one utterance.  "
+                "Above 1, the states of a position are pruned with the prune beam against the best of them instead of "
+                "by the search queue, so --steps_threshold is not used and lattices differ from those of a single thread");
+    po.Register("profile_wspecifier", &profile_wspecifier, "If set, write per-utterance counters: "
+                "states expanded, arcs added, queue updates, beam prunes, matcher misses and compose time in seconds");
+    po.Register("utt2dur_rspecifier", &utt2dur_rspecifier, "If set, read utterance durations to report the real-time factor, e.g. ark,t:data/utt2dur");
+    po.Register("lattice_input", &lattice_input, "Read phone lattices instead of observation fsts");
+    po.Register("acoustic_scale", &acoustic_scale, "Scaling factor for acoustic likelihoods of lattice input");
+    po.Register("lm_scale", &lm_scale, "Scaling factor for graph/lm costs of lattice input");
+    po.Register("lattice_queue_size", &lattice_queue_size, "Number of observations read ahead of the decoder");
+    po.Register("separable_lattice_wspecifier", &separable_lattice_wspecifier, "If set, also write lattices with the "
+                "unscaled lex cost separate from the other costs, pruned like the output fsts");
+    PhoneSausageOptions sausage_opts;
+    sausage_opts.Register(&po);
+    MinimumBayesRiskOptions mbr_opts;
+    mbr_opts.Register(&po);
     po.Read(argc, argv);
 
     if (po.NumArgs() != 6) {
@@ -46,57 +289,89 @@ int main(int argc, char *argv[]) {
         target_wspecifier = po.GetArg(5),
         fst_wspecifier = po.GetArg(6);
 
-    fst::StdVectorFst *lex_fst = fst::ReadFstKaldi(lex_fst_filename);
-    fst::StdVectorFst *ali_fst = fst::ReadFstKaldi(ali_fst_filename);
-    fst::StdVectorFst *lm_fst = fst::ReadFstKaldi(lm_fst_rspecifier);
-
-    fst::ArcMap(lex_fst, fst::PowerMapper<fst::StdArc>(power));
+    if (lattice_queue_size < 1) {
+      KALDI_ERR << "--lattice_queue_size must be at least 1";
+    }
 
-    fst::StdVectorFst la_fst;
-    fst::Compose(*lex_fst, *ali_fst, &la_fst);
+    if (!separable_lattice_wspecifier.empty()) {
+      if (power <= 0) {
+        KALDI_ERR << "Separable lattices need a positive power";
+      }
+      model_opts.separable_scores = true;
+    }
 
-    SequentialTableReader<fst::VectorFstHolder> source_reader(source_rspecifier);
-    Int32VectorWriter target_writer(target_wspecifier);
-    TableWriter<VectorFstHolder> fst_writer(fst_wspecifier);
-    for (; !source_reader.Done(); source_reader.Next()) {
-      const std::string key = source_reader.Key();
-      fst::StdVectorFst observation_fst(source_reader.Value());
-      fst::ArcSort(&observation_fst, fst::OLabelCompare<fst::StdArc>());
+    kaldi::Timer load_timer;
+    DeciphermentModel model(lex_fst_filename, ali_fst_filename, lm_fst_rspecifier, power, model_opts);
 
-      ThreeWayComposition<fst::StdArc> tc(observation_fst, la_fst, *lm_fst, steps_threshold, prune_beam, -1);
-      fst::StdVectorFst deciphered_fst = tc.GetFst();
+    ThroughputStats throughput_stats;
+    throughput_stats.SetLoadTime(load_timer.Elapsed());
+    RandomAccessBaseFloatReader utt2dur_reader;
+    if (!utt2dur_rspecifier.empty() && !utt2dur_reader.Open(utt2dur_rspecifier)) {
+      KALDI_ERR << "Could not open utt2dur rspecifier " << utt2dur_rspecifier;
+    }
 
-      fst::StdVectorFst shortest_path;
-      fst::ShortestPath(deciphered_fst, &shortest_path);
+    DecipherOptions opts;
+    opts.prune_beam = prune_beam;
+    opts.steps_threshold = steps_threshold;
+    opts.output_prune_beam = output_prune_beam;
+    opts.prune_output = prune_output;
+    opts.remove_weights = remove_weights;
+    opts.chunk_carry_state = chunk_carry_state;
+    opts.compose_threads = compose_threads;
 
-      std::vector<int32> tgt_sequence;
-      fst::GetLinearSymbolSequence<fst::StdArc, int32>(shortest_path, NULL, &tgt_sequence, NULL);
+    Int32VectorWriter target_writer(target_wspecifier);
+    TableWriter<VectorFstHolder> fst_writer(fst_wspecifier);
+    LatticeWriter separable_lattice_writer;
+    if (!separable_lattice_wspecifier.empty() && !separable_lattice_writer.Open(separable_lattice_wspecifier)) {
+      KALDI_ERR << "Could not open separable lattice wspecifier " << separable_lattice_wspecifier;
+    }
+    LatticeWriter *separable_lattice_writer_ptr = separable_lattice_writer.IsOpen() ? &separable_lattice_writer : NULL;
+    DecipherTask::ProfileWriter profile_writer;
+    if (!profile_wspecifier.empty() && !profile_writer.Open(profile_wspecifier)) {
+      KALDI_ERR << "Could not open profile wspecifier " << profile_wspecifier;
+    }
+    DecipherTask::ProfileWriter *profile_writer_ptr = profile_writer.IsOpen() ? &profile_writer : NULL;
+    DeciphermentStats total_stats;
 
-      if (tgt_sequence.size() > 0) {
-        target_writer.Write(key, tgt_sequence);
+    // Composition buffers, one per worker thread.
+    DecipherTask::WorkspacePool workspaces;
+    DecipherTask::LatticeWorkspacePool lattice_workspaces;
+    TaskSequencerConfig config;
+    config.num_threads = num_threads;
+    TaskSequencer<DecipherTask> sequencer(config);
+    kaldi::Timer decode_timer;
+    ObservationReader source_reader(source_rspecifier, lattice_input, acoustic_scale, lm_scale, mbr_opts, sausage_opts, lattice_queue_size);
+    SourceObservation source_observation;
+    while (source_reader.Next(&source_observation)) {
+      const std::string key = source_observation.key;
+      fst::StdVectorFst observation_fst(source_observation.fst);
+      fst::ArcSort(&observation_fst, fst::OLabelCompare<fst::StdArc>());
 
-        fst::StdVectorFst output_fst;
-        if (prune_output) {
-          fst::Prune(&deciphered_fst, output_prune_beam);
-        }
-        fst::Project(&deciphered_fst, fst::PROJECT_OUTPUT);
-        if (remove_weights) {
-          fst::RemoveWeights(&deciphered_fst);
-        }
-        fst::RmEpsilon(&deciphered_fst);
-        fst::Determinize(deciphered_fst, &output_fst);
-        fst::Minimize(&output_fst);
+      std::vector<fst::StdVectorFst> chunks;
+      if (chunk_silence_threshold > 0) {
+        SplitObservationAtSilence(observation_fst, chunk_silence_threshold, chunk_min_length, &chunks);
+      } else {
+        chunks.push_back(observation_fst);
+      }
 
-        fst_writer.Write(key, output_fst);
-        KALDI_LOG << key << " processed with fst " << output_fst.NumStates() << " states and " << fst::NumArcs(output_fst) << " arcs";
+      double duration = (utt2dur_reader.IsOpen() && utt2dur_reader.HasKey(key)) ? utt2dur_reader.Value(key) : 0;
+      DecipheredUtterance *utterance = new DecipheredUtterance(key, duration);
+      if (chunk_carry_state || chunks.size() == 1) {
+        sequencer.Run(new DecipherTask(&opts, &model, chunks, utterance, true, &target_writer, &fst_writer, separable_lattice_writer_ptr, profile_writer_ptr, &total_stats, &throughput_stats, &workspaces, &lattice_workspaces));
       } else {
-        KALDI_LOG << key << " is empty";
+        for (size_t i = 0; i < chunks.size(); i++) {
+          std::vector<fst::StdVectorFst> chunk(1, chunks[i]);
+          bool is_last_task = i + 1 == chunks.size();
+          sequencer.Run(new DecipherTask(&opts, &model, chunk, utterance, is_last_task, &target_writer, &fst_writer, separable_lattice_writer_ptr, profile_writer_ptr, &total_stats, &throughput_stats, &workspaces, &lattice_workspaces));
+        }
       }
     }
-
-    delete lex_fst;
-    delete ali_fst;
-    delete lm_fst;
+    sequencer.Wait();
+    if (!source_reader.Error().empty()) {
+      KALDI_ERR << "Failed to read " << source_rspecifier << ": " << source_reader.Error();
+    }
+    KALDI_LOG << "Total " << total_stats.ToString();
+    KALDI_LOG << "Throughput " << throughput_stats.Report(decode_timer.Elapsed());
 
     return 0;
   } catch(const std::exception &e) {
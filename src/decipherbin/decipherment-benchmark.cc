@@ -0,0 +1,221 @@
+#include <random>
+
+#include "base/kaldi-common.h"
+#include "util/common-utils.h"
+#include "fstext/fstext-utils.h"
+#include "decipherment-cascade.h"
+#include "synthetic-models.h"
+#include "benchmark-utils.h"
+#include "state-order.h"
+
+
+// Prints one tab-separated result line: benchmark name, repeat, total seconds,
+// number of items processed and items per second.
+void PrintResult(const std::string &name, int repeat, double seconds, int64_t num_items) {
+  std::cout << name << "\t" << repeat << "\t" << seconds << "\t" << num_items << "\t"
+            << (seconds > 0 ? num_items / seconds : 0) << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  try {
+    using namespace kaldi;
+    using namespace fst;
+    typedef kaldi::int32 int32;
+
+    const char *usage =
+        "Times the decipherment components on synthetic models and observations\n"
+        "and prints tab-separated results: benchmark, repeat, seconds, items, items/second.\n"
+        "\n"
+        "Usage:\n"
+        " decipherment-benchmark [options]\n";
+
+    int num_src_syms = 40;
+    int num_tgt_syms = 30;
+    int lm_branching = 10;
+    int num_observations = 20;
+    int observation_length = 50;
+    int sausage_width = 1;
+    float silence_rate = 0.05;
+    float prune_beam = 8;
+    int steps_threshold = 5;
+    int num_repeats = 3;
+    int seed = 0;
+    bool standard = true;
+    bool validate_linear = false;
+    float validate_tolerance = 1e-3;
+
+    ParseOptions po(usage);
+    po.Register("num-source-symbols", &num_src_syms, "Number of source symbols");
+    po.Register("num-target-symbols", &num_tgt_syms, "Number of target symbols");
+    po.Register("lm-branching", &lm_branching, "Number of successors of every LM history");
+    po.Register("num-observations", &num_observations, "Number of observations");
+    po.Register("observation-length", &observation_length, "Number of slots in every observation");
+    po.Register("sausage-width", &sausage_width, "Number of arcs per slot; 1 gives linear observations");
+    po.Register("silence-rate", &silence_rate, "Probability of a slot being silence");
+    po.Register("prune-beam", &prune_beam, "Prune beam");
+    po.Register("steps-threshold", &steps_threshold, "Steps threshold");
+    po.Register("num-repeats", &num_repeats, "Number of times every benchmark is repeated");
+    po.Register("seed", &seed, "Random seed");
+    po.Register("standard", &standard, "Also benchmark the standard (non-threeway) composer, which is slow for large LMs");
+    po.Register("validate-linear", &validate_linear, "Instead of timing, check that linear accumulators "
+                "give the likelihood and models of log ones within --validate-tolerance, and fail otherwise");
+    po.Register("validate-tolerance", &validate_tolerance, "Largest difference of the likelihood relative to its value, "
+                "and of model probabilities, allowed by --validate-linear");
+    po.Read(argc, argv);
+
+    if (po.NumArgs() != 0) {
+      po.PrintUsage();
+      exit(1);
+    }
+
+    std::mt19937 rng(seed);
+    VectorFst<LogArc> lex_fst, ali_fst, lm_fst;
+    MakeSyntheticLexFst(num_src_syms, num_tgt_syms, &rng, &lex_fst);
+    MakeSyntheticAliFst(num_tgt_syms, 2, 0.1, 2, 0.1, &ali_fst);
+    MakeSyntheticLmFst(num_tgt_syms, lm_branching, &rng, &lm_fst);
+
+    std::vector<VectorFst<LogArc>> observations(num_observations);
+    std::vector<StdVectorFst> std_observations(num_observations);
+    for (int i = 0; i < num_observations; i++) {
+      MakeSyntheticObservation(num_src_syms, observation_length, sausage_width, silence_rate, &rng, &observations[i]);
+      Cast(observations[i], &std_observations[i]);
+    }
+
+    StdVectorFst std_lex_fst, std_ali_fst, std_lm_fst, std_la_fst;
+    Cast(lex_fst, &std_lex_fst);
+    Cast(ali_fst, &std_ali_fst);
+    Cast(lm_fst, &std_lm_fst);
+    Compose(std_lex_fst, std_ali_fst, &std_la_fst);
+
+    // The same models with states renumbered breadth-first.
+    StdVectorFst sorted_la_fst(std_la_fst), sorted_lm_fst(std_lm_fst);
+    SortStatesBreadthFirst(&sorted_la_fst);
+    SortStatesBreadthFirst(&sorted_lm_fst);
+    DenseMatcher<StdArc> sorted_matcher(sorted_la_fst);
+    CacheMissCounter cache_misses;
+
+    if (validate_linear) {
+      // One accumulator for all observations, as for a single job in
+      // decipherment-learn, added to a log total.
+      ThreewayComposer<LogArc> composer(lex_fst, ali_fst, lm_fst, prune_beam, steps_threshold);
+      DeciphermentCascade<LogArc> cascade(true, true, &lex_fst, &ali_fst), linear_cascade(true, true, &lex_fst, &ali_fst);
+      Expectations<LogArc> expectations(num_src_syms, num_tgt_syms, ali_fst.NumStates(), lex_fst.NumStates()),
+          linear_expectations(num_src_syms, num_tgt_syms, ali_fst.NumStates(), lex_fst.NumStates());
+      expectations.Reset(1000);
+      linear_expectations.Reset(1000);
+      Expectations<LogArc> task_expectations(num_src_syms, num_tgt_syms, ali_fst.NumStates(), lex_fst.NumStates());
+      Expectations<LogArc> linear_task_expectations =
+          Expectations<LogArc>::Linear(num_src_syms, num_tgt_syms, ali_fst.NumStates(), lex_fst.NumStates());
+      Composition<LogArc> workspace;
+      for (const auto &observation: observations) {
+        cascade.ComputeExpectations(composer, observation, task_expectations, NULL, 1, &workspace);
+        cascade.ComputeExpectations(composer, observation, linear_task_expectations, NULL, 1, &workspace);
+      }
+      expectations.Add(task_expectations);
+      linear_expectations.Add(linear_task_expectations);
+      cascade.Maximize(expectations);
+      linear_cascade.Maximize(linear_expectations);
+
+      double likelihood = expectations.Likelihood().Value(),
+          linear_likelihood = linear_expectations.Likelihood().Value();
+      double likelihood_difference = fabs(likelihood - linear_likelihood) / std::max(1.0, fabs(likelihood));
+      double model_difference = std::max(MaxProbabilityDifference(cascade.LexFst(), linear_cascade.LexFst()),
+                                         MaxProbabilityDifference(cascade.AliFst(), linear_cascade.AliFst()));
+      bool is_valid = likelihood_difference <= validate_tolerance && model_difference <= validate_tolerance;
+      std::cout << "validate-linear\tlikelihood " << likelihood << " vs " << linear_likelihood
+                << "\tmax-model-difference " << model_difference << "\t" << (is_valid ? "ok" : "failed") << std::endl;
+      return is_valid ? 0 : 1;
+    }
+
+    std::cout << "# benchmark\trepeat\tseconds\titems\titems_per_second" << std::endl;
+    for (int repeat = 0; repeat < num_repeats; repeat++) {
+      Timer timer;
+      DenseMatcher<StdArc> matcher(std_la_fst);
+      PrintResult("dense-matcher", repeat, timer.Elapsed(), std_la_fst.NumStates());
+
+      // Cache misses are reported as items, or -1 if they cannot be counted.
+      auto run_threeway = [&](const std::string &name, const StdVectorFst &la_fst, const StdVectorFst &lm_fst,
+                              const DenseMatcher<StdArc> &la_matcher) {
+        Timer compose_timer;
+        int64_t num_states = 0;
+        ThreeWayComposition<StdArc> tc;
+        cache_misses.Start();
+        for (const auto &observation: std_observations) {
+          tc.Compose(observation, la_fst, lm_fst, la_matcher, ThreeWayComposeOptions(steps_threshold, prune_beam, -1));
+          num_states += tc.GetFst().NumStates();
+        }
+        int64_t num_cache_misses = cache_misses.Stop();
+        PrintResult(name, repeat, compose_timer.Elapsed(), num_observations);
+        PrintResult(name + "-states", repeat, compose_timer.Elapsed(), num_states);
+        PrintResult(name + "-cache-misses", repeat, compose_timer.Elapsed(), num_cache_misses);
+      };
+      // Alternate which model order goes first, so that neither always
+      // runs with the caches warmed up by the other.
+      if (repeat % 2 == 0) {
+        run_threeway("threeway-composition", std_la_fst, std_lm_fst, matcher);
+        run_threeway("threeway-composition-sorted-states", sorted_la_fst, sorted_lm_fst, sorted_matcher);
+      } else {
+        run_threeway("threeway-composition-sorted-states", sorted_la_fst, sorted_lm_fst, sorted_matcher);
+        run_threeway("threeway-composition", std_la_fst, std_lm_fst, matcher);
+      }
+
+      if (standard) {
+        timer.Reset();
+        StandardComposer<LogArc> standard_composer(lex_fst, ali_fst, lm_fst);
+        PrintResult("standard-composer-init", repeat, timer.Elapsed(), 1);
+
+        timer.Reset();
+        Composition<LogArc> composition;
+        for (const auto &observation: observations) {
+          standard_composer.Compose(observation, &composition);
+        }
+        PrintResult("standard-compose", repeat, timer.Elapsed(), num_observations);
+
+        timer.Reset();
+        StandardComposer<LogArc> lazy_lm_composer(lex_fst, ali_fst, lm_fst, true);
+        for (const auto &observation: observations) {
+          lazy_lm_composer.Compose(observation, &composition);
+        }
+        PrintResult("standard-compose-lazy-lm", repeat, timer.Elapsed(), num_observations);
+      }
+
+      ThreewayComposer<LogArc> composer(lex_fst, ali_fst, lm_fst, prune_beam, steps_threshold);
+      DeciphermentCascade<LogArc> cascade(true, true, &lex_fst, &ali_fst);
+      Expectations<LogArc> expectations(num_src_syms, num_tgt_syms, ali_fst.NumStates(), lex_fst.NumStates());
+      expectations.Reset(1000);
+
+      timer.Reset();
+      Composition<LogArc> workspace;
+      for (const auto &observation: observations) {
+        cascade.ComputeExpectations(composer, observation, expectations, NULL, 1, &workspace);
+      }
+      PrintResult("compute-expectations", repeat, timer.Elapsed(), num_observations);
+
+      timer.Reset();
+      Expectations<LogArc> linear_expectations =
+          Expectations<LogArc>::Linear(num_src_syms, num_tgt_syms, ali_fst.NumStates(), lex_fst.NumStates());
+      for (const auto &observation: observations) {
+        cascade.ComputeExpectations(composer, observation, linear_expectations, NULL, 1, &workspace);
+      }
+      PrintResult("compute-expectations-linear", repeat, timer.Elapsed(), num_observations);
+
+      Expectations<LogArc> total_expectations(num_src_syms, num_tgt_syms, ali_fst.NumStates(), lex_fst.NumStates());
+      timer.Reset();
+      total_expectations.Add(expectations);
+      PrintResult("expectations-add", repeat, timer.Elapsed(), 1);
+
+      timer.Reset();
+      total_expectations.Add(linear_expectations);
+      PrintResult("expectations-add-linear", repeat, timer.Elapsed(), 1);
+
+      timer.Reset();
+      cascade.Maximize(expectations);
+      PrintResult("maximize", repeat, timer.Elapsed(), 1);
+    }
+
+    return 0;
+  } catch(const std::exception &e) {
+    std::cerr << e.what();
+    return -1;
+  }
+}
@@ -1,3 +1,8 @@
+#include <algorithm>
+#include <memory>
+#include <thread>
+
+#include "fstext/fstext-utils.h"
 #include "composer.h"
 #include "expectations.h"
 
@@ -11,16 +16,45 @@ class DeciphermentCascade {
     using Label = typename Arc::Label;
     using Weight = typename Arc::Weight;
 
+    // With viterbi_nbest > 0, expectations are collected from the n best paths
+    // of each composition instead of all of its paths.
     DeciphermentCascade(
-        bool train_lex, bool train_ali, Fst *lex_fst, Fst *ali_fst
-    ): train_lex_(train_lex), train_ali_(train_ali), lex_fst_(*lex_fst), ali_fst_(*ali_fst) {}
+        bool train_lex, bool train_ali, Fst *lex_fst, Fst *ali_fst, int viterbi_nbest = 0
+    ): train_lex_(train_lex), train_ali_(train_ali), viterbi_nbest_(viterbi_nbest), lex_fst_(*lex_fst), ali_fst_(*ali_fst) {}
+
+    // An observation with count > 1 stands for that many identical ones: its
+    // posteriors are multiplied by count and its likelihood raised to count.
+    // The composition is built in workspace, which a thread can pass to every
+    // call to reuse its buffers, or in a temporary one if it is NULL.
+    void ComputeExpectations(
+        const Composer<Arc> &composer, const Fst &ifst, Expectations<Arc> &expectations,
+        DeciphermentStats *stats = NULL, int count = 1, Composition<Arc> *workspace = NULL
+    ) const {
+      std::unique_ptr<Composition<Arc>> temporary;
+      if (workspace == NULL) {
+        temporary.reset(new Composition<Arc>());
+        workspace = temporary.get();
+      }
 
-    void ComputeExpectations(const Composer<Arc> &composer, const Fst &ifst, Expectations<Arc> &expectations) const {
-      Composition<Arc> *composition = composer.Compose(ifst);
+      if (viterbi_nbest_ > 0) {
+        ComputeViterbiExpectations(composer, ifst, expectations, stats, count, workspace);
+        return;
+      }
 
+      Composition<Arc> *composition = workspace;
+      composer.Compose(ifst, composition);
+      if (stats != NULL) {
+        *stats = composition->stats;
+      }
+
+      kaldi::Timer timer;
       std::vector<Weight> alphas, betas;
       fst::ShortestDistance(composition->fst, &alphas, /*reverse=*/false);
       fst::ShortestDistance(composition->fst, &betas, /*reverse=*/true);
+      if (stats != NULL) {
+        stats->forward_backward_time = timer.Elapsed();
+      }
+
       if (betas.size() == 0) {
         KALDI_WARN << "Empty composition?";
         return;
@@ -32,7 +66,10 @@ class DeciphermentCascade {
         return;
       }
 
-      expectations.AddLikelihood(likelihood);
+      timer.Reset();
+
+      expectations.AddLikelihood(Weight(likelihood.Value() * count));
+      Weight log_count = Weight(-log(count));
       for (fst::StateIterator<Fst> siter(composition->fst); !siter.Done(); siter.Next()) {
         StateId state = siter.Value();
         StateId lex_state = composition->lex_state[state];
@@ -42,7 +79,7 @@ class DeciphermentCascade {
         for (fst::ArcIterator<Fst> aiter(composition->fst, state); !aiter.Done(); aiter.Next()) {
           auto arc = aiter.Value();
           Weight beta = (arc.nextstate < betas.size()) ? betas[arc.nextstate] : Weight::Zero();
-          Weight posterior = fst::Divide(Times(Times(alpha, arc.weight), beta), likelihood);
+          Weight posterior = Times(fst::Divide(Times(Times(alpha, arc.weight), beta), likelihood), log_count);
 
           if (beta == Weight::Zero()) {
             continue;
@@ -52,53 +89,215 @@ class DeciphermentCascade {
         }
       }
 
-      delete composition;
+      if (stats != NULL) {
+        stats->accumulate_time = timer.Elapsed();
+      }
     }
 
-    void Maximize(const Expectations<Arc> &expectations) {
+    // Updates the arc weights of both models from the expectations, spreading
+    // the arcs of all states over num_threads threads, since the lex fst
+    // usually has a single state.  Lex arcs whose weight becomes zero are
+    // removed in place, which keeps the remaining arcs in olabel order.
+    void Maximize(const Expectations<Arc> &expectations, int num_threads = 1) {
       if (train_ali_) {
-        for (fst::StateIterator<Fst> siter(ali_fst_); !siter.Done(); siter.Next()) {
-          StateId state = siter.Value();
-          for (fst::MutableArcIterator<Fst> aiter(&ali_fst_, state); !aiter.Done(); aiter.Next()) {
-            auto arc = aiter.Value();
-            arc.weight = expectations.MaximizeAli(state, arc.ilabel, arc.olabel);
-            aiter.SetValue(arc);
-          }
-        }
+        uint64_t sort_properties = ali_fst_.Properties(fst::kILabelSorted | fst::kOLabelSorted, false);
+        std::vector<std::vector<Weight>> weights;
+        ComputeWeights(ali_fst_, num_threads, [&expectations](StateId state, const Arc &arc) {
+          return expectations.MaximizeAli(state, arc.ilabel, arc.olabel);
+        }, &weights);
+        SetWeights(weights, /*remove_zero_weights=*/false, &ali_fst_);
+        ali_fst_.SetProperties(sort_properties, fst::kILabelSorted | fst::kOLabelSorted);
       }
 
       if (train_lex_) {
-        bool mutation = false;
-        for (fst::StateIterator<Fst> siter(lex_fst_); !siter.Done(); siter.Next()) {
-          StateId state = siter.Value();
-          for (fst::MutableArcIterator<Fst> aiter(&lex_fst_, state); !aiter.Done(); aiter.Next()) {
-            auto arc = aiter.Value();
-            arc.weight = expectations.MaximizeLex(state, arc.ilabel, arc.olabel);
-            arc.nextstate = (arc.weight == Weight::Zero()) ? lex_fst_.NumStates() : arc.nextstate;
-            mutation |= arc.weight == Weight::Zero();
-            aiter.SetValue(arc);
-          }
-        }
+        uint64_t sort_properties = lex_fst_.Properties(fst::kILabelSorted | fst::kOLabelSorted, false);
+        std::vector<std::vector<Weight>> weights;
+        ComputeWeights(lex_fst_, num_threads, [&expectations](StateId state, const Arc &arc) {
+          return expectations.MaximizeLex(state, arc.ilabel, arc.olabel);
+        }, &weights);
 
-        if (mutation) {
-          lex_fst_.AddState();
+        if (SetWeights(weights, /*remove_zero_weights=*/true, &lex_fst_)) {
+          // A state without arcs left may have become a dead end.
           fst::Connect(&lex_fst_);
-          fst::ArcSort(&lex_fst_, fst::OLabelCompare<Arc>());
         }
+        lex_fst_.SetProperties(sort_properties, fst::kILabelSorted | fst::kOLabelSorted);
       }
     }
 
-    void GetAliFst(Fst *ofst) {
-      *ofst = ali_fst_;
+    const Fst &AliFst() const {
+      return ali_fst_;
+    }
+
+    const Fst &LexFst() const {
+      return lex_fst_;
     }
 
-    void GetLexFst(Fst *ofst) {
-      *ofst = lex_fst_;
+    void SetAliFst(const Fst &ali_fst) {
+      ali_fst_ = ali_fst;
+    }
+
+    void SetLexFst(const Fst &lex_fst) {
+      lex_fst_ = lex_fst;
     }
 
 
   private:
+    // Finds the n best paths on a tropical copy of the composition whose labels
+    // are replaced by arc indices, so that arcs on the paths can be traced back
+    // to their lex and ali states.  Each path gets its share of the n-best
+    // probability mass as posterior, i.e. 1 for plain Viterbi training, and the
+    // likelihood is that of the n best paths.
+    void ComputeViterbiExpectations(
+        const Composer<Arc> &composer, const Fst &ifst, Expectations<Arc> &expectations,
+        DeciphermentStats *stats, int count, Composition<Arc> *composition
+    ) const {
+      composer.Compose(ifst, composition);
+      if (stats != NULL) {
+        *stats = composition->stats;
+      }
+
+      kaldi::Timer timer;
+      std::vector<StateId> arc_states;
+      std::vector<Arc> arcs;
+      fst::StdVectorFst indexed_fst;
+      for (fst::StateIterator<Fst> siter(composition->fst); !siter.Done(); siter.Next()) {
+        indexed_fst.AddState();
+      }
+      for (fst::StateIterator<Fst> siter(composition->fst); !siter.Done(); siter.Next()) {
+        StateId state = siter.Value();
+        indexed_fst.SetFinal(state, composition->fst.Final(state).Value());
+        for (fst::ArcIterator<Fst> aiter(composition->fst, state); !aiter.Done(); aiter.Next()) {
+          const Arc &arc = aiter.Value();
+          arc_states.push_back(state);
+          arcs.push_back(arc);
+          indexed_fst.AddArc(state, fst::StdArc(arcs.size(), arcs.size(), arc.weight.Value(), arc.nextstate));
+        }
+      }
+      indexed_fst.SetStart(composition->fst.Start());
+
+      fst::StdVectorFst nbest_fst;
+      std::vector<fst::StdVectorFst> paths;
+      fst::ShortestPath(indexed_fst, &nbest_fst, viterbi_nbest_);
+      fst::ConvertNbestToVector(nbest_fst, &paths);
+      if (stats != NULL) {
+        stats->forward_backward_time = timer.Elapsed();
+      }
+
+      if (paths.empty()) {
+        KALDI_WARN << "Empty composition?";
+        return;
+      }
+
+      timer.Reset();
+      std::vector<Weight> path_weights;
+      Weight likelihood = Weight::Zero();
+      for (const auto &path: paths) {
+        fst::TropicalWeight path_weight = fst::TropicalWeight::One();
+        for (fst::StateIterator<fst::StdVectorFst> siter(path); !siter.Done(); siter.Next()) {
+          for (fst::ArcIterator<fst::StdVectorFst> aiter(path, siter.Value()); !aiter.Done(); aiter.Next()) {
+            path_weight = fst::Times(path_weight, aiter.Value().weight);
+          }
+          if (path.Final(siter.Value()) != fst::TropicalWeight::Zero()) {
+            path_weight = fst::Times(path_weight, path.Final(siter.Value()));
+          }
+        }
+        path_weights.push_back(Weight(path_weight.Value()));
+        likelihood = fst::Plus(likelihood, path_weights.back());
+      }
+
+      expectations.AddLikelihood(Weight(likelihood.Value() * count));
+      for (size_t p = 0; p < paths.size(); p++) {
+        Weight posterior = Times(fst::Divide(path_weights[p], likelihood), Weight(-log(count)));
+        for (fst::StateIterator<fst::StdVectorFst> siter(paths[p]); !siter.Done(); siter.Next()) {
+          for (fst::ArcIterator<fst::StdVectorFst> aiter(paths[p], siter.Value()); !aiter.Done(); aiter.Next()) {
+            size_t index = aiter.Value().ilabel - 1;
+            StateId state = arc_states[index];
+            expectations.AddObservation(composition->lex_state[state], composition->ali_state[state],
+                                        arcs[index].ilabel, arcs[index].olabel, posterior);
+          }
+        }
+      }
+
+      if (stats != NULL) {
+        stats->accumulate_time = timer.Elapsed();
+      }
+    }
+
+    // Computes the new weight of every arc, with the arcs of all states split
+    // into num_threads contiguous ranges.
+    template <class WeightFunction>
+    static void ComputeWeights(
+        const Fst &fst, int num_threads, const WeightFunction &weight_function,
+        std::vector<std::vector<Weight>> *weights
+    ) {
+      std::vector<size_t> offsets(1, 0);
+      weights->resize(fst.NumStates());
+      for (StateId state = 0; state < fst.NumStates(); state++) {
+        (*weights)[state].resize(fst.NumArcs(state));
+        offsets.push_back(offsets.back() + fst.NumArcs(state));
+      }
+
+      auto worker = [&fst, &weight_function, &offsets, weights](size_t begin, size_t end) {
+        StateId state = std::upper_bound(offsets.begin(), offsets.end(), begin) - offsets.begin() - 1;
+        for (; state < fst.NumStates() && offsets[state] < end; state++) {
+          size_t arc_begin = std::max(begin, offsets[state]) - offsets[state];
+          size_t arc_end = std::min(end, offsets[state + 1]) - offsets[state];
+          fst::ArcIterator<Fst> aiter(fst, state);
+          for (aiter.Seek(arc_begin); aiter.Position() < arc_end; aiter.Next()) {
+            (*weights)[state][aiter.Position()] = weight_function(state, aiter.Value());
+          }
+        }
+      };
+
+      size_t num_arcs = offsets.back();
+      num_threads = (num_arcs < kMinArcsPerThread * num_threads) ? std::max<size_t>(1, num_arcs / kMinArcsPerThread) : num_threads;
+      if (num_threads <= 1) {
+        worker(0, num_arcs);
+        return;
+      }
+
+      size_t block_size = (num_arcs + num_threads - 1) / num_threads;
+      std::vector<std::thread> threads;
+      for (int t = 0; t < num_threads; t++) {
+        threads.push_back(std::thread(worker, std::min(t * block_size, num_arcs), std::min((t + 1) * block_size, num_arcs)));
+      }
+      for (auto &thread: threads) {
+        thread.join();
+      }
+    }
+
+    // Sets the new weights.  With remove_zero_weights, arcs with a non-zero
+    // weight are moved to the front of their state, in their original order,
+    // and the rest are deleted.  Returns true if a state lost all of its arcs.
+    static bool SetWeights(const std::vector<std::vector<Weight>> &weights, bool remove_zero_weights, Fst *fst) {
+      bool has_emptied_state = false;
+      for (StateId state = 0; state < fst->NumStates(); state++) {
+        size_t num_kept = 0, num_arcs = fst->NumArcs(state);
+        for (fst::MutableArcIterator<Fst> aiter(fst, state); !aiter.Done(); aiter.Next()) {
+          if (remove_zero_weights && weights[state][aiter.Position()] == Weight::Zero()) {
+            continue;
+          }
+
+          Arc arc = aiter.Value();
+          arc.weight = weights[state][aiter.Position()];
+          size_t position = aiter.Position();
+          aiter.Seek(num_kept++);
+          aiter.SetValue(arc);
+          aiter.Seek(position);
+        }
+
+        if (num_kept < num_arcs) {
+          fst->DeleteArcs(state, num_arcs - num_kept);
+          has_emptied_state |= num_kept == 0;
+        }
+      }
+      return has_emptied_state;
+    }
+
+    static const size_t kMinArcsPerThread = 10000;
+
     bool train_lex_, train_ali_;
+    int viterbi_nbest_;
     Fst lex_fst_, ali_fst_;
 
 };
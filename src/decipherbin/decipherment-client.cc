@@ -0,0 +1,100 @@
+#include "base/kaldi-common.h"
+#include "util/common-utils.h"
+#include "fstext/kaldi-fst-io.h"
+#include "line-socket.h"
+
+
+int main(int argc, char *argv[]) {
+  try {
+    using namespace kaldi;
+    using namespace fst;
+    typedef kaldi::int32 int32;
+
+    const char *usage =
+        "Sends observations to a running decipherment-server and writes its outputs.\n"
+        "With --reload only, asks the server to load a new lex fst and exits.\n"
+        "\n"
+        "Usage:\n"
+        " decipherment-client [options] <socket-path> <source-rspecifier> <target-wspecifier> <fst-wspecifier>\n"
+        " decipherment-client --reload=<lex-filename> <socket-path>\n";
+
+    std::string reload_lex_filename = "";
+
+    ParseOptions po(usage);
+    po.Register("reload", &reload_lex_filename, "Lex fst the server should switch to before decoding");
+    po.Read(argc, argv);
+
+    if (po.NumArgs() != 4 && !(po.NumArgs() == 1 && !reload_lex_filename.empty())) {
+      po.PrintUsage();
+      exit(1);
+    }
+
+    std::string socket_path = po.GetArg(1);
+    int fd = LineSocket::Connect(socket_path);
+    if (fd < 0) {
+      KALDI_ERR << "Could not connect to " << socket_path;
+    }
+    LineSocket connection(fd);
+
+    std::string header, block;
+    if (!reload_lex_filename.empty()) {
+      if (!connection.Write("RELOAD " + reload_lex_filename + "\n") ||
+          !connection.ReadLine(&header) || !connection.ReadBlock(&block)) {
+        KALDI_ERR << "Lost connection to " << socket_path;
+      }
+      if (header != "RELOADED") {
+        KALDI_ERR << "Server failed to reload " << reload_lex_filename << ": " << header;
+      }
+      KALDI_LOG << "Server reloaded " << reload_lex_filename;
+    }
+
+    if (po.NumArgs() == 1) {
+      return 0;
+    }
+
+    std::string source_rspecifier = po.GetArg(2),
+        target_wspecifier = po.GetArg(3),
+        fst_wspecifier = po.GetArg(4);
+
+    SequentialTableReader<VectorFstHolder> source_reader(source_rspecifier);
+    Int32VectorWriter target_writer(target_wspecifier);
+    TableWriter<VectorFstHolder> fst_writer(fst_wspecifier);
+
+    int num_done = 0, num_empty = 0, num_failed = 0;
+    for (; !source_reader.Done(); source_reader.Next()) {
+      std::string key = source_reader.Key();
+      if (!connection.Write("DECODE " + key + "\n" + FstToText(source_reader.Value()) + "\n") ||
+          !connection.ReadLine(&header) || !connection.ReadBlock(&block)) {
+        KALDI_ERR << "Lost connection to " << socket_path;
+      }
+
+      std::istringstream is(header);
+      std::string status, response_key;
+      is >> status >> response_key;
+      if (status == "RESULT") {
+        std::vector<int32> tgt_sequence;
+        int32 symbol;
+        while (is >> symbol) {
+          tgt_sequence.push_back(symbol);
+        }
+        StdVectorFst output_fst;
+        FstFromText(block, &output_fst);
+        target_writer.Write(key, tgt_sequence);
+        fst_writer.Write(key, output_fst);
+        num_done++;
+      } else if (status == "EMPTY") {
+        KALDI_WARN << "Empty output for " << key;
+        num_empty++;
+      } else {
+        KALDI_WARN << "Failed to decode " << key << ": " << header;
+        num_failed++;
+      }
+    }
+
+    KALDI_LOG << "Decoded " << num_done << " utterances, " << num_empty << " empty, " << num_failed << " failed";
+    return (num_done != 0 ? 0 : 1);
+  } catch(const std::exception &e) {
+    std::cerr << e.what();
+    return -1;
+  }
+}
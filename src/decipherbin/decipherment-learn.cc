@@ -1,38 +1,128 @@
+#include <unordered_map>
+
 #include "base/kaldi-common.h"
 #include "util/common-utils.h"
 #include "fstext/fstext-utils.h"
 #include "fstext/kaldi-fst-io.h"
 #include "util/kaldi-thread.h"
 #include "decipherment-cascade.h"
+#include "chunking.h"
+#include "lexical-model.h"
+#include "training-schedule.h"
+#include "squarem.h"
+#include "checkpoint.h"
+#include "object-pool.h"
+
+// An observation with the number of identical observations it stands for.
+template <class Arc>
+struct Observation {
+  std::string key;
+  fst::VectorFst<Arc> fst;
+  int count = 1;
+};
+
+// Hash of the states, arcs and final weights of an fst in state and arc
+// order, so that fsts built the same way from the same input hash the same.
+template <class Arc>
+size_t HashObservation(const fst::VectorFst<Arc> &ifst) {
+  size_t hash = ifst.Start();
+  auto combine = [&hash](size_t value) { hash ^= value + 0x9e3779b9 + (hash << 6) + (hash >> 2); };
+  for (fst::StateIterator<fst::VectorFst<Arc>> siter(ifst); !siter.Done(); siter.Next()) {
+    combine(std::hash<float>()(ifst.Final(siter.Value()).Value()));
+    for (fst::ArcIterator<fst::VectorFst<Arc>> aiter(ifst, siter.Value()); !aiter.Done(); aiter.Next()) {
+      const Arc &arc = aiter.Value();
+      combine(arc.ilabel);
+      combine(arc.olabel);
+      combine(arc.nextstate);
+      combine(std::hash<float>()(arc.weight.Value()));
+    }
+  }
+  return hash;
+}
 
+// Saves the expectations of an iteration after every interval tasks, once
+// the tasks before them have been added too.
+template <class Arc>
+class AccumulatorCheckpointer {
+  public:
+    AccumulatorCheckpointer(
+        const std::string &dir, int stage, int iter, int task_size, int interval, int num_tasks_done
+    ): dir_(dir), stage_(stage), iter_(iter), task_size_(task_size), interval_(interval), num_tasks_done_(num_tasks_done) {}
+
+    void TaskDone(const Expectations<Arc> &expectations) {
+      num_tasks_done_++;
+      if (num_tasks_done_ % interval_ == 0) {
+        WriteAccumulatorCheckpoint(dir_, stage_, iter_, num_tasks_done_, task_size_, expectations);
+      }
+    }
+
+  private:
+    std::string dir_;
+    int stage_, iter_, task_size_, interval_, num_tasks_done_;
+
+};
+
+// Accumulates the expectations of a task of observations.  Their counters are
+// written to profile_writer, if not NULL, under their keys prefixed with
+// profile_key_prefix, which tells the stages and iterations apart.
 template <class Arc>
 class ExpectationTask {
   public:
+    typedef kaldi::TableWriter<kaldi::BasicVectorHolder<double>> ProfileWriter;
+
     ExpectationTask(
         const DeciphermentCascade<Arc> *cascade,
         const Composer<Arc> *composer,
-        const std::vector<fst::VectorFst<Arc>> *observations,
+        const std::vector<Observation<Arc>> *observations,
         Expectations<Arc> *task_expectations,
-        Expectations<Arc> *total_expectations
-    ): cascade_(cascade), composer_(composer), observations_(observations), task_expectations_(task_expectations), total_expectations_(total_expectations) { }
+        Expectations<Arc> *total_expectations,
+        DeciphermentStats *total_stats,
+        ProfileWriter *profile_writer,
+        const std::string &profile_key_prefix,
+        AccumulatorCheckpointer<Arc> *checkpointer,
+        ObjectPool<Composition<Arc>> *workspaces
+    ): cascade_(cascade), composer_(composer), observations_(observations), task_expectations_(task_expectations),
+       total_expectations_(total_expectations), total_stats_(total_stats), profile_writer_(profile_writer),
+       profile_key_prefix_(profile_key_prefix), checkpointer_(checkpointer), workspaces_(workspaces) { }
 
   void operator() () {
+    std::unique_ptr<Composition<Arc>> workspace = workspaces_->Acquire();
     for (const auto &observation: *observations_) {
-      cascade_->ComputeExpectations(*composer_, observation, *task_expectations_);
+      DeciphermentStats stats;
+      cascade_->ComputeExpectations(*composer_, observation.fst, *task_expectations_, &stats, observation.count, workspace.get());
+      stats_.push_back(stats);
     }
+    workspaces_->Release(std::move(workspace));
   }
 
   ~ExpectationTask() {
     total_expectations_->Add(*task_expectations_);
     delete task_expectations_;
+
+    for (size_t i = 0; i < stats_.size(); i++) {
+      total_stats_->Add(stats_[i]);
+      if (profile_writer_ != NULL) {
+        profile_writer_->Write(profile_key_prefix_ + (*observations_)[i].key, stats_[i].ToVector());
+      }
+    }
+
+    if (checkpointer_ != NULL) {
+      checkpointer_->TaskDone(*total_expectations_);
+    }
   }
 
  private:
    const DeciphermentCascade<Arc> *cascade_;
    const Composer<Arc> *composer_;
-   const std::vector<fst::VectorFst<Arc>> *observations_;
+   const std::vector<Observation<Arc>> *observations_;
    Expectations<Arc> *task_expectations_;
    Expectations<Arc> *total_expectations_;
+   DeciphermentStats *total_stats_;
+   ProfileWriter *profile_writer_;
+   std::string profile_key_prefix_;
+   AccumulatorCheckpointer<Arc> *checkpointer_;
+   ObjectPool<Composition<Arc>> *workspaces_;
+   std::vector<DeciphermentStats> stats_;
 
 };
 
@@ -48,7 +138,8 @@ int main(int argc, char *argv[]) {
 
     const char *usage =
         "Usage:\n"
-        " decipherment-learn <lex-filename> <ali-filename> <lm-filename> <source-rspecifier> <lex-wfilename> <ali-wfilename>\n";
+        " decipherment-learn <lex-filename> <ali-filename> <lm-filename> <source-rspecifier> <lex-wfilename> <ali-wfilename>\n"
+        " decipherment-learn --schedule=<stages> <lex-filename> <ali-filename> <source-rspecifier> <lex-wfilename> <ali-wfilename>\n";
 
     int num_src_syms = -1;
     int num_tgt_syms = -1;
@@ -58,7 +149,36 @@ int main(int argc, char *argv[]) {
     int num_threads = 1;
     bool threeway = false;
     float prune_beam = 8;
+    float initial_prune_beam = 0;
+    float prune_beam_step = 2;
+    float widen_beam_threshold = 0.001;
+    float retry_prune_beam = 0;
+    int retry_min_states = 0;
     int steps_threshold = 5;
+    float chunk_silence_threshold = 0;
+    int chunk_min_length = 20;
+    std::string profile_wspecifier;
+    std::string schedule;
+    float smooth_output = 0;
+    float convergence_threshold = 0;
+    bool squarem = false;
+    float squarem_max_step = 4;
+    int viterbi_nbest = 0;
+    std::string checkpoint_dir;
+    bool resume = false;
+    int accumulator_checkpoint_interval = 0;
+    float lex_posterior_floor = 0;
+    int lex_top_k = 0;
+    bool merge_duplicates = true;
+    bool sort_states = false;
+    bool lazy_lm = false;
+    bool push_lm = false;
+    bool lm_lookahead = false;
+    int online_batch_size = 0;
+    float online_step_decay = 0.7;
+    std::string online_stats_rxfilename;
+    std::string online_stats_wxfilename;
+    bool linear_accumulators = false;
 
     ParseOptions po(usage);
     po.Register("num-source-symbols", &num_src_syms, "Number of source symbols");
@@ -69,92 +189,538 @@ int main(int argc, char *argv[]) {
     po.Register("num-threads", &num_threads, "Number of threads");
     po.Register("threeway", &threeway, "Use threeway composition?");
     po.Register("prune-beam", &prune_beam, "Prune beam");
+    po.Register("initial-prune-beam", &initial_prune_beam, "If >0, prune beam of the first iteration of a threeway stage, "
+                "widened by --prune-beam-step up to --prune-beam whenever the likelihood changes by at most --widen-beam-threshold");
+    po.Register("prune-beam-step", &prune_beam_step, "Step by which the prune beam is widened");
+    po.Register("widen-beam-threshold", &widen_beam_threshold, "Relative change of the likelihood between iterations "
+                "below which the prune beam is widened");
+    po.Register("retry-prune-beam", &retry_prune_beam, "If larger than the prune beam, compose observations again with "
+                "this beam when no final state is reached or the composition is smaller than --retry-min-states");
+    po.Register("retry-min-states", &retry_min_states, "Compositions with fewer states are retried with --retry-prune-beam");
     po.Register("steps-threshold", &steps_threshold, "Steps threshold");
+    po.Register("chunk-silence-threshold", &chunk_silence_threshold, "If >0, split observations after slots with silence posterior above this threshold.  "
+                "Every chunk is trained as a sentence of its own, from the LM start state to an LM final state, "
+                "since the LM state does not carry over between chunks; not allowed with threeway stages");
+    po.Register("chunk-min-length", &chunk_min_length, "Minimum number of slots in a chunk");
+    po.Register("profile-wspecifier", &profile_wspecifier, "If set, write per-utterance counters for every iteration, "
+                "under keys s<stage>-i<iter>-<utterance>: "
+                "states expanded, arcs added, queue updates, beam prunes, matcher misses, and compose, "
+                "forward-backward and accumulate time in seconds, and compose retries");
+    po.Register("schedule", &schedule, "If set, train in stages "
+                "<lm-filename>:<num-iters>:<standard|threeway>[:<key>=<value>...] separated by commas, with keys "
+                "train-lex, train-ali, prune-beam, initial-prune-beam, retry-prune-beam, steps-threshold, viterbi, prune-top and smooth; "
+                "other options are the defaults "
+                "of every stage and the lm-filename argument is omitted");
+    po.Register("smooth-output", &smooth_output, "If >0, smooth the lexical model with this weight before writing it");
+    po.Register("checkpoint-dir", &checkpoint_dir, "If set, save the models and likelihoods to this directory after every iteration");
+    po.Register("accumulator-checkpoint-interval", &accumulator_checkpoint_interval, "If >0 and --checkpoint-dir is set, "
+                "also save the expectations after about every this many observations within an iteration");
+    po.Register("resume", &resume, "Continue from the checkpoint in --checkpoint-dir, if there is one");
+    po.Register("viterbi", &viterbi_nbest, "If >0, train on this many best paths of every observation "
+                "instead of running forward-backward over all paths");
+    po.Register("lex-posterior-floor", &lex_posterior_floor, "If >0, remove lex arcs with P(source|target) below this "
+                "after every iteration");
+    po.Register("lex-top-k", &lex_top_k, "If >0, keep only this many targets per source symbol in the lex model "
+                "after every iteration");
+    po.Register("sort-states", &sort_states, "Renumber the states of the LM and lex∘ali breadth-first for memory locality "
+                "in threeway stages");
+    po.Register("lazy-lm", &lazy_lm, "In standard stages, compose every observation with lex∘ali and then the LM "
+                "instead of building lex∘ali∘LM, which is large for high order LMs");
+    po.Register("push-lm", &push_lm, "In threeway stages, push LM weights towards the start state");
+    po.Register("lm-lookahead", &lm_lookahead, "In threeway stages, add the best LM cost to a final state to the search "
+                "priorities, which allows a tighter prune beam");
+    po.Register("linear-accumulators", &linear_accumulators, "Accumulate the expectations of every task as "
+                "probabilities in double sums rather than log weights, added to the log total when the task is done");
+    po.Register("merge-duplicates", &merge_duplicates, "Process identical observations once, weighted by their count");
+    po.Register("convergence-threshold", &convergence_threshold, "If >0, end a stage once the relative change of the likelihood "
+                "between iterations is at most this");
+    po.Register("squarem", &squarem, "Accelerate EM by SQUAREM extrapolation of the lexical model, "
+                "falling back to the EM update when the likelihood gets worse");
+    po.Register("squarem-max-step", &squarem_max_step, "Largest SQUAREM step length, in units of the EM step (at least 1)");
+    po.Register("online-batch-size", &online_batch_size, "If >0, run stepwise EM: update the models after every "
+                "mini-batch of this many observations, from running expectations interpolated with step (k+2)^-decay "
+                "at the k-th update");
+    po.Register("online-step-decay", &online_step_decay, "Decay of the stepwise EM step size, in (0.5, 1]");
+    po.Register("online-stats-in", &online_stats_rxfilename, "If set, continue stepwise EM from the running expectations "
+                "in this file, e.g. to adapt a model to new observations only");
+    po.Register("online-stats-out", &online_stats_wxfilename, "If set, write the running expectations of stepwise EM "
+                "after every mini-batch, or the expectations per observation of every iteration of batch EM, "
+                "for --online-stats-in");
     po.Read(argc, argv);
 
     if (num_src_syms == -1 || num_tgt_syms == -1) {
       KALDI_ERR << "num-source-symbols and num-target-symbols have to be larger than 0";
     }
 
-    if (po.NumArgs() != 6) {
+    if (online_batch_size > 0 && (squarem || accumulator_checkpoint_interval > 0)) {
+      KALDI_ERR << "--online-batch-size cannot be combined with --squarem or --accumulator-checkpoint-interval";
+    }
+
+    if (po.NumArgs() != (schedule.empty() ? 6 : 5)) {
       po.PrintUsage();
       exit(1);
     }
 
-    std::string lex_fst_filename = po.GetArg(1),
-        ali_fst_filename = po.GetArg(2),
-        lm_fst_rspecifier = po.GetArg(3),
-        source_rspecifier = po.GetArg(4),
-        lex_fst_wfilename = po.GetArg(5),
-        ali_fst_wfilename = po.GetArg(6);
+    TrainingStage default_stage;
+    default_stage.num_iters = num_iters;
+    default_stage.threeway = threeway;
+    default_stage.train_lex = train_lex;
+    default_stage.train_ali = train_ali;
+    default_stage.prune_beam = prune_beam;
+    default_stage.initial_prune_beam = initial_prune_beam;
+    default_stage.retry_prune_beam = retry_prune_beam;
+    default_stage.steps_threshold = steps_threshold;
+    default_stage.viterbi_nbest = viterbi_nbest;
+
+    std::vector<TrainingStage> stages;
+    int arg = 1;
+    std::string lex_fst_filename = po.GetArg(arg++),
+        ali_fst_filename = po.GetArg(arg++);
+    if (schedule.empty()) {
+      default_stage.lm_fst_filename = po.GetArg(arg++);
+      stages.push_back(default_stage);
+    } else {
+      ParseTrainingSchedule(schedule, default_stage, &stages);
+    }
+    if (chunk_silence_threshold > 0) {
+      for (const auto &stage: stages) {
+        if (stage.threeway) {
+          KALDI_ERR << "--chunk-silence-threshold cannot be used with threeway stages, "
+                    << "which would end a sentence at every chunk boundary";
+        }
+      }
+    }
+    std::string source_rspecifier = po.GetArg(arg++),
+        lex_fst_wfilename = po.GetArg(arg++),
+        ali_fst_wfilename = po.GetArg(arg++);
 
     SequentialTableReader<fst::VectorFstHolder> source_reader(source_rspecifier);
-    std::vector<std::vector<fst::VectorFst<fst::LogArc>>> observation_per_job(num_threads);
+    std::vector<std::vector<Observation<fst::LogArc>>> observation_per_job(num_threads);
     std::vector<int> cost_per_job(num_threads);
-    int i = 0;
+    // Observations by hash, as (job, index) pairs.
+    std::unordered_map<size_t, std::vector<std::pair<int, size_t>>> observations_by_hash;
+    int num_observations = 0, num_merged = 0;
     for (; !source_reader.Done(); source_reader.Next()) {
       const std::string key = source_reader.Key();
       fst::VectorFst<fst::LogArc> observation_fst;
       fst::Cast(source_reader.Value(), &observation_fst);
-      fst::ArcSort(&observation_fst, fst::OLabelCompare<fst::LogArc>());
 
-      int job = 0;
-      for (int i = 1; i < num_threads; i++) {
-        if (cost_per_job[i] < cost_per_job[job]) {
-          job = i;
-	}
+      // Chunks are treated as independent observations, each starting from the LM start state.
+      std::vector<fst::VectorFst<fst::LogArc>> chunks;
+      if (chunk_silence_threshold > 0) {
+        SplitObservationAtSilence(observation_fst, chunk_silence_threshold, chunk_min_length, &chunks);
+      } else {
+        chunks.push_back(observation_fst);
+      }
+
+      for (size_t c = 0; c < chunks.size(); c++) {
+        Observation<fst::LogArc> observation;
+        observation.key = (chunks.size() == 1) ? key : key + "-" + std::to_string(c);
+        observation.fst = chunks[c];
+        fst::ArcSort(&observation.fst, fst::OLabelCompare<fst::LogArc>());
+        num_observations++;
+
+        size_t hash = 0;
+        bool is_merged = false;
+        if (merge_duplicates) {
+          hash = HashObservation(observation.fst);
+          for (const auto &location: observations_by_hash[hash]) {
+            Observation<fst::LogArc> &other = observation_per_job[location.first][location.second];
+            if (fst::Equal(other.fst, observation.fst, 0)) {
+              other.count++;
+              is_merged = true;
+              break;
+            }
+          }
+        }
+        if (is_merged) {
+          num_merged++;
+          continue;
+        }
+
+        int job = 0;
+        for (int i = 1; i < num_threads; i++) {
+          if (cost_per_job[i] < cost_per_job[job]) {
+            job = i;
+          }
+        }
+
+        cost_per_job[job] += fst::NumArcs(observation.fst);
+        if (merge_duplicates) {
+          observations_by_hash[hash].push_back(std::make_pair(job, observation_per_job[job].size()));
+        }
+        observation_per_job[job].push_back(observation);
+      }
+    }
+    observations_by_hash.clear();
+    KALDI_LOG << "Read " << num_observations << " observations, " << num_merged << " of them merged into identical ones";
+
+    // For accumulator checkpoints, the observations of every job are split into
+    // tasks of task_size observations, started in turns across jobs.  Tasks are
+    // added to the total in the order they were started, so the accumulator
+    // always covers a prefix of them.
+    int task_size = 0, checkpoint_interval_tasks = 0;
+    std::vector<std::vector<Observation<fst::LogArc>>> observation_per_task;
+    if (!checkpoint_dir.empty() && accumulator_checkpoint_interval > 0) {
+      task_size = std::max(1, accumulator_checkpoint_interval / num_threads);
+      checkpoint_interval_tasks = std::max(1, accumulator_checkpoint_interval / task_size);
+      for (size_t begin = 0; ; begin += task_size) {
+        bool is_done = true;
+        for (const auto &observations: observation_per_job) {
+          if (begin < observations.size()) {
+            size_t end = std::min(begin + task_size, observations.size());
+            observation_per_task.emplace_back(observations.begin() + begin, observations.begin() + end);
+            is_done = false;
+          }
+        }
+        if (is_done) {
+          break;
+        }
       }
+      observation_per_job.clear();
+    } else {
+      observation_per_task.swap(observation_per_job);
+    }
 
-      observation_per_job[job].push_back(observation_fst);
-      cost_per_job[job] += fst::NumArcs(observation_fst);
+    // For stepwise EM, mini-batches of online_batch_size observations taken
+    // in turns across jobs, split into one task per thread.
+    std::vector<std::vector<std::vector<Observation<fst::LogArc>>>> observation_per_batch;
+    std::vector<int> count_per_batch;
+    if (online_batch_size > 0) {
+      for (size_t i = 0, num_done = 0; ; i++) {
+        bool is_done = true;
+        for (const auto &observations: observation_per_task) {
+          if (i < observations.size()) {
+            if (num_done % online_batch_size == 0) {
+              observation_per_batch.emplace_back(num_threads);
+              count_per_batch.push_back(0);
+            }
+            observation_per_batch.back()[num_done % num_threads].push_back(observations[i]);
+            count_per_batch.back() += observations[i].count;
+            num_done++;
+            is_done = false;
+          }
+        }
+        if (is_done) {
+          break;
+        }
+      }
+      KALDI_LOG << "Stepwise EM over " << observation_per_batch.size() << " mini-batches per iteration";
     }
 
     fst::StdVectorFst *lex_fst = fst::ReadFstKaldi(lex_fst_filename);
     fst::StdVectorFst *ali_fst = fst::ReadFstKaldi(ali_fst_filename);
-    fst::StdVectorFst *lm_fst = fst::ReadFstKaldi(lm_fst_rspecifier);
-    fst::Project(lm_fst, fst::PROJECT_INPUT);
 
-    fst::VectorFst<fst::LogArc> log_lex_fst, log_ali_fst, log_lm_fst;
+    fst::VectorFst<fst::LogArc> log_lex_fst, log_ali_fst;
     fst::Cast(*lex_fst, &log_lex_fst);
     fst::Cast(*ali_fst, &log_ali_fst);
-    fst::Cast(*lm_fst, &log_lm_fst);
 
-    DeciphermentCascade<fst::LogArc> cascade(train_lex, train_ali, &log_lex_fst, &log_ali_fst);
-    for (int iter = 0; iter < num_iters; iter++) {
-      kaldi::Timer timer;
-      std::cerr << "Iter " << iter;
+    // Composition buffers of the worker threads, kept for the whole run.
+    ObjectPool<Composition<fst::LogArc>> workspaces;
+    TrainingCheckpoint checkpoint;
+    if (resume) {
+      if (checkpoint_dir.empty()) {
+        KALDI_ERR << "--resume requires --checkpoint-dir";
+      }
 
-      Expectations<fst::LogArc> total_expectations(num_src_syms, num_tgt_syms, ali_fst->NumStates(), lex_fst->NumStates());
-      if (threeway) {
-        total_expectations.Reset(1000);
+      if (ReadTrainingCheckpoint(checkpoint_dir, &checkpoint, &log_lex_fst, &log_ali_fst)) {
+        KALDI_LOG << "Resuming from stage " << checkpoint.stage << " iteration " << checkpoint.iter;
+      } else {
+        KALDI_LOG << "No checkpoint in " << checkpoint_dir << ", starting from the beginning";
       }
+    }
+    const int resume_stage = checkpoint.stage, resume_iter = checkpoint.iter;
+
+    // Running expectations of stepwise EM, sized at the first update unless
+    // read here.  A checkpoint holds those of its models.
+    Expectations<fst::LogArc> online_stats;
+    int online_updates = 0;
+    bool has_online_stats = false;
+    if (online_batch_size > 0) {
+      if (resume && ReadOnlineStats(checkpoint_dir + "/online_stats", &online_updates, &online_stats)) {
+        has_online_stats = true;
+      } else if (!online_stats_rxfilename.empty()) {
+        if (!ReadOnlineStats(online_stats_rxfilename, &online_updates, &online_stats)) {
+          KALDI_ERR << "Could not read " << online_stats_rxfilename;
+        }
+        has_online_stats = true;
+      }
+      if (has_online_stats) {
+        KALDI_LOG << "Continuing stepwise EM after " << online_updates << " updates";
+      }
+    }
 
+    ExpectationTask<fst::LogArc>::ProfileWriter profile_writer;
+    if (!profile_wspecifier.empty() && !profile_writer.Open(profile_wspecifier)) {
+      KALDI_ERR << "Could not open profile wspecifier " << profile_wspecifier;
+    }
 
-      Composer<fst::LogArc> *composer;
-      if (threeway) {
-        composer = new ThreewayComposer<fst::LogArc>(log_lex_fst, log_ali_fst, log_lm_fst, prune_beam, steps_threshold);
-      } else {
-        composer = new StandardComposer<fst::LogArc>(log_lex_fst, log_ali_fst, log_lm_fst);
+    for (int s = resume_stage; s < stages.size(); s++) {
+      const TrainingStage &stage = stages[s];
+      // Pruning and smoothing were already applied to the model of a checkpoint within a stage.
+      const int start_iter = (s == resume_stage) ? resume_iter : 0;
+      if (stage.prune_top > 0 && start_iter == 0) {
+        fst::VectorFst<fst::LogArc> pruned_lex_fst;
+        PruneLexicalModel(log_lex_fst, num_src_syms, num_tgt_syms, stage.prune_top, &pruned_lex_fst);
+        log_lex_fst = pruned_lex_fst;
       }
 
-      TaskSequencerConfig config;
-      config.num_threads = num_threads;
-      TaskSequencer<ExpectationTask<fst::LogArc>> sequencer(config);
-      for (const auto &observations: observation_per_job) {
-        auto task_expectations = new Expectations<fst::LogArc>(num_src_syms, num_tgt_syms, ali_fst->NumStates(), lex_fst->NumStates());
-        sequencer.Run(new ExpectationTask<fst::LogArc>(&cascade, composer, &observations, task_expectations, &total_expectations));
+      if (stage.smooth_alpha > 0 && start_iter == 0) {
+        fst::VectorFst<fst::LogArc> smoothed_lex_fst;
+        SmoothLexicalModel(log_lex_fst, num_src_syms, num_tgt_syms, stage.smooth_alpha, &smoothed_lex_fst);
+        log_lex_fst = smoothed_lex_fst;
       }
-      sequencer.Wait();
 
-      std::cerr << " maximizing ";
-      cascade.Maximize(total_expectations);
-      cascade.GetAliFst(&log_ali_fst);
-      cascade.GetLexFst(&log_lex_fst);
+      if (stage.num_iters == 0) {
+        continue;
+      }
 
-      std::cerr << " lex states " << log_lex_fst.NumStates() << " lex arcs " << fst::NumArcs(log_lex_fst);
+      if (stages.size() > 1) {
+        KALDI_LOG << "Stage " << s << " with " << stage.lm_fst_filename << ", " << stage.num_iters << " iterations"
+                  << (stage.threeway ? ", threeway" : "") << " lex arcs " << fst::NumArcs(log_lex_fst);
+      }
+
+      fst::StdVectorFst *lm_fst = fst::ReadFstKaldi(stage.lm_fst_filename);
+      fst::Project(lm_fst, fst::PROJECT_INPUT);
+      fst::VectorFst<fst::LogArc> log_lm_fst;
+      fst::Cast(*lm_fst, &log_lm_fst);
+      delete lm_fst;
+      if (push_lm && stage.threeway) {
+        fst::Push(&log_lm_fst, fst::REWEIGHT_TO_INITIAL);
+      }
+      if (sort_states && stage.threeway) {
+        SortStatesBreadthFirst(&log_lm_fst);
+      }
+      std::vector<float> lm_potentials;
+      if (lm_lookahead && stage.threeway) {
+        fst::ComputeLookaheadPotentials(log_lm_fst, &lm_potentials);
+      }
+
+      DeciphermentCascade<fst::LogArc> cascade(stage.train_lex, stage.train_ali, &log_lex_fst, &log_ali_fst, stage.viterbi_nbest);
+
+      // With SQUAREM, every cycle runs two EM steps from lex0, i.e. E-steps at
+      // lex0 and lex1 giving lex1 and lex2, and then an E-step at the model
+      // extrapolated from lex0, lex1 and lex2.  lex2 itself is never evaluated,
+      // so the extrapolated model is kept if it is at least as likely as lex1,
+      // the last evaluated model, and otherwise replaced by lex2.  This only
+      // guarantees that the likelihood does not fall below that of lex1.  The
+      // extrapolated E-step also starts the next cycle.
+      int squarem_phase = 0;
+      fst::VectorFst<fst::LogArc> lex0, fallback_lex_fst, fallback_ali_fst;
+      double reference_likelihood = 0, previous_likelihood = 0;
+      bool has_previous_likelihood = false;
+      if (start_iter > 0 && !checkpoint.history.empty() && checkpoint.history.back().stage == s) {
+        previous_likelihood = checkpoint.history.back().likelihood;
+        has_previous_likelihood = true;
+      }
+
+      // Checkpoints hold the last evaluated model, i.e. not an extrapolated
+      // one, and a resumed run starts a new SQUAREM cycle.
+      auto write_checkpoint = [&](int iter, bool stage_done) {
+        if (checkpoint_dir.empty()) {
+          return;
+        }
+        checkpoint.stage = stage_done ? s + 1 : s;
+        checkpoint.iter = stage_done ? 0 : iter + 1;
+        bool is_extrapolated = squarem_phase == 2;
+        WriteTrainingCheckpoint(checkpoint_dir, checkpoint, is_extrapolated ? fallback_lex_fst : cascade.LexFst(),
+                                is_extrapolated ? fallback_ali_fst : cascade.AliFst());
+        RemoveAccumulatorCheckpoint(checkpoint_dir);
+        if (has_online_stats) {
+          WriteOnlineStats(checkpoint_dir + "/online_stats", online_updates, online_stats);
+        }
+      };
+
+      // Beam schedule of threeway stages, replayed from the likelihoods of the
+      // checkpoint when resuming within the stage.
+      float beam = (stage.threeway && stage.initial_prune_beam > 0) ? std::min(stage.initial_prune_beam, stage.prune_beam) : stage.prune_beam;
+      auto widen_beam = [&](double previous, double current) {
+        if (beam < stage.prune_beam && fabs(previous - current) <= widen_beam_threshold * fabs(previous)) {
+          beam = std::min(beam + prune_beam_step, stage.prune_beam);
+          return true;
+        }
+        return false;
+      };
+      const TrainingCheckpoint::Entry *previous_entry = NULL;
+      for (const auto &entry: checkpoint.history) {
+        if (entry.stage == s && entry.iter < start_iter) {
+          if (previous_entry != NULL) {
+            widen_beam(previous_entry->likelihood, entry.likelihood);
+          }
+          previous_entry = &entry;
+        }
+      }
+
+      for (int iter = start_iter; iter < stage.num_iters; iter++) {
+        kaldi::Timer timer;
+        std::cerr << "Iter " << iter;
+
+        auto new_expectations = [&]() {
+          Expectations<fst::LogArc> expectations(num_src_syms, num_tgt_syms, cascade.AliFst().NumStates(), cascade.LexFst().NumStates());
+          if (stage.threeway) {
+            expectations.Reset(1000);
+          }
+          return expectations;
+        };
+
+        auto new_composer = [&]() -> Composer<fst::LogArc> * {
+          if (stage.threeway) {
+            auto threeway_composer = new ThreewayComposer<fst::LogArc>(cascade.LexFst(), cascade.AliFst(), log_lm_fst, beam, stage.steps_threshold,
+                                                                      stage.viterbi_nbest == 1 ? 1 : -1, sort_states,
+                                                                      lm_lookahead ? &lm_potentials : NULL);
+            threeway_composer->SetRetry(stage.retry_prune_beam, retry_min_states);
+            return threeway_composer;
+          }
+          return new StandardComposer<fst::LogArc>(cascade.LexFst(), cascade.AliFst(), log_lm_fst, lazy_lm);
+        };
+
+        // Adds the expectations of the tasks from first_task on to expectations.
+        auto accumulate = [&](const Composer<fst::LogArc> *composer, const std::vector<std::vector<Observation<fst::LogArc>>> &tasks,
+                              size_t first_task, Expectations<fst::LogArc> *expectations, DeciphermentStats *stats,
+                              AccumulatorCheckpointer<fst::LogArc> *checkpointer) {
+          TaskSequencerConfig config;
+          config.num_threads = num_threads;
+          TaskSequencer<ExpectationTask<fst::LogArc>> sequencer(config);
+          std::string profile_key_prefix = "s" + std::to_string(s) + "-i" + std::to_string(iter) + "-";
+          for (size_t t = first_task; t < tasks.size(); t++) {
+            auto task_expectations = new Expectations<fst::LogArc>(linear_accumulators ?
+                Expectations<fst::LogArc>::Linear(num_src_syms, num_tgt_syms, cascade.AliFst().NumStates(), cascade.LexFst().NumStates()) :
+                Expectations<fst::LogArc>(num_src_syms, num_tgt_syms, cascade.AliFst().NumStates(), cascade.LexFst().NumStates()));
+            sequencer.Run(new ExpectationTask<fst::LogArc>(
+                &cascade, composer, &tasks[t], task_expectations, expectations,
+                stats, profile_writer.IsOpen() ? &profile_writer : NULL, profile_key_prefix, checkpointer, &workspaces
+            ));
+          }
+          sequencer.Wait();
+        };
+
+        Expectations<fst::LogArc> total_expectations = new_expectations();
+        DeciphermentStats total_stats;
+        double likelihood = 0;
+        if (online_batch_size > 0) {
+          // Stepwise EM: the running expectations move towards those of every
+          // mini-batch, per observation, and the models are updated from them.
+          for (size_t b = 0; b < observation_per_batch.size(); b++) {
+            Expectations<fst::LogArc> batch_expectations = new_expectations();
+            std::unique_ptr<Composer<fst::LogArc>> composer(new_composer());
+            accumulate(composer.get(), observation_per_batch[b], 0, &batch_expectations, &total_stats, NULL);
+            likelihood += batch_expectations.Likelihood().Value();
+
+            if (!has_online_stats) {
+              online_stats = new_expectations();
+              online_stats.Reset();
+              has_online_stats = true;
+            }
+            double step = pow(online_updates + 2, -online_step_decay);
+            online_stats.Interpolate(batch_expectations, 1 - step, step / count_per_batch[b]);
+            online_updates++;
+
+            total_expectations = online_stats;
+            if (stage.train_lex && (lex_posterior_floor > 0 || lex_top_k > 0)) {
+              total_expectations.SparsifyLex(lex_posterior_floor, lex_top_k);
+            }
+            cascade.Maximize(total_expectations, num_threads);
+            if (!online_stats_wxfilename.empty()) {
+              WriteOnlineStats(online_stats_wxfilename, online_updates, online_stats);
+            }
+          }
+        } else {
+          std::unique_ptr<Composer<fst::LogArc>> composer(new_composer());
+
+          // Extrapolated models are not checkpointed, so neither are their expectations.
+          int num_tasks_done = 0;
+          bool checkpoint_accumulator = task_size > 0 && squarem_phase != 2;
+          if (checkpoint_accumulator && resume && s == resume_stage && iter == resume_iter &&
+              ReadAccumulatorCheckpoint(checkpoint_dir, s, iter, task_size, &num_tasks_done, &total_expectations)) {
+            KALDI_LOG << "Resuming iteration after " << num_tasks_done << " of " << observation_per_task.size() << " tasks";
+          }
+          AccumulatorCheckpointer<fst::LogArc> checkpointer(checkpoint_dir, s, iter, task_size, checkpoint_interval_tasks, num_tasks_done);
+          accumulate(composer.get(), observation_per_task, num_tasks_done, &total_expectations, &total_stats,
+                     checkpoint_accumulator ? &checkpointer : NULL);
+          likelihood = total_expectations.Likelihood().Value();
+        }
+
+        if (squarem_phase == 2 && likelihood > reference_likelihood) {
+          std::cerr << " rejected extrapolated model with likelihood " << likelihood << std::endl;
+          cascade.SetLexFst(fallback_lex_fst);
+          cascade.SetAliFst(fallback_ali_fst);
+          squarem_phase = 0;
+          write_checkpoint(iter, iter + 1 == stage.num_iters);
+          continue;
+        }
+
+        fst::VectorFst<fst::LogArc> previous_lex_fst;
+        if (squarem) {
+          previous_lex_fst = cascade.LexFst();
+        }
+
+        std::cerr << " maximizing ";
+        if (online_batch_size <= 0) {
+          // Stepwise EM continues from the full expectations, so they are
+          // written before sparsifying.
+          if (!online_stats_wxfilename.empty()) {
+            Expectations<fst::LogArc> stats_per_observation = new_expectations();
+            stats_per_observation.Interpolate(total_expectations, 0, 1.0 / num_observations);
+            WriteOnlineStats(online_stats_wxfilename, 0, stats_per_observation);
+          }
+          if (stage.train_lex && (lex_posterior_floor > 0 || lex_top_k > 0)) {
+            total_expectations.SparsifyLex(lex_posterior_floor, lex_top_k);
+          }
+          cascade.Maximize(total_expectations, num_threads);
+        }
+
+        std::cerr << " lex states " << cascade.LexFst().NumStates() << " lex arcs " << fst::NumArcs(cascade.LexFst());
+
+        std::cerr << " likelihood " << likelihood << " done in " << timer.Elapsed() << " seconds" << std::endl;
+        KALDI_LOG << "Iter " << iter << " " << total_stats.ToString();
+        checkpoint.history.push_back({s, iter, likelihood});
+
+        // A stage has not converged while its beam is still being widened.
+        if (has_previous_likelihood && convergence_threshold > 0 && beam >= stage.prune_beam &&
+            fabs(previous_likelihood - likelihood) <= convergence_threshold * fabs(previous_likelihood)) {
+          KALDI_LOG << "Converged after " << iter + 1 << " iterations, likelihood " << likelihood;
+          write_checkpoint(iter, true);
+          break;
+        }
+        if (has_previous_likelihood && widen_beam(previous_likelihood, likelihood)) {
+          KALDI_LOG << "Iter " << iter << " widened prune beam to " << beam;
+        }
+        previous_likelihood = likelihood;
+        has_previous_likelihood = true;
+
+        if (squarem && squarem_phase == 1) {
+          fallback_lex_fst = cascade.LexFst();
+          fallback_ali_fst = cascade.AliFst();
+          // The E-step of this iteration was at lex1, the model before this M-step.
+          reference_likelihood = likelihood;
+
+          fst::VectorFst<fst::LogArc> extrapolated_lex_fst;
+          double alpha = ExtrapolateLexFst(lex0, previous_lex_fst, cascade.LexFst(), &extrapolated_lex_fst, squarem_max_step);
+          cascade.SetLexFst(extrapolated_lex_fst);
+          KALDI_LOG << "Iter " << iter << " extrapolated lex model with step " << -alpha;
+          squarem_phase = 2;
+        } else if (squarem) {
+          lex0 = previous_lex_fst;
+          squarem_phase = 1;
+        }
+
+        write_checkpoint(iter, iter + 1 == stage.num_iters);
+      }
+
+      // An extrapolated model that was never evaluated is not kept.
+      if (squarem_phase == 2) {
+        log_lex_fst = fallback_lex_fst;
+        log_ali_fst = fallback_ali_fst;
+      } else {
+        log_lex_fst = cascade.LexFst();
+        log_ali_fst = cascade.AliFst();
+      }
+    }
 
-      std::cerr << " likelihood " << total_expectations.Likelihood() << " done in " << timer.Elapsed() << " seconds" << std::endl;
-      delete composer;
+    if (smooth_output > 0) {
+      fst::VectorFst<fst::LogArc> smoothed_lex_fst;
+      SmoothLexicalModel(log_lex_fst, num_src_syms, num_tgt_syms, smooth_output, &smoothed_lex_fst);
+      log_lex_fst = smoothed_lex_fst;
     }
 
     fst::Cast(log_ali_fst, ali_fst);
@@ -165,7 +731,6 @@ int main(int argc, char *argv[]) {
 
     delete lex_fst;
     delete ali_fst;
-    delete lm_fst;
 
     return 0;
   } catch(const std::exception &e) {
@@ -0,0 +1,209 @@
+#include <cerrno>
+#include <mutex>
+#include <thread>
+
+#include "base/kaldi-common.h"
+#include "util/common-utils.h"
+#include "fstext/fstext-utils.h"
+#include "fstext/kaldi-fst-io.h"
+#include "decoder.h"
+#include "bounded-queue.h"
+#include "line-socket.h"
+
+
+// Current model, replaced atomically when a new lex fst is loaded.  Requests
+// in flight keep using the model they started with.
+class ModelHolder {
+
+  public:
+    explicit ModelHolder(std::shared_ptr<const DeciphermentModel> model): model_(model) {}
+
+    std::shared_ptr<const DeciphermentModel> Get() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return model_;
+    }
+
+    void Reload(const std::string &lex_fst_filename, float power) {
+      std::shared_ptr<const DeciphermentModel> model = std::make_shared<DeciphermentModel>(*Get(), lex_fst_filename, power);
+      std::lock_guard<std::mutex> lock(mutex_);
+      model_ = model;
+    }
+
+  private:
+    std::mutex mutex_;
+    std::shared_ptr<const DeciphermentModel> model_;
+
+};
+
+// Handles requests of one client until it disconnects.  Every response is a
+// header line followed by a block ending with an empty line:
+//   DECODE <key>\n<observation fst in text form>\n  -> RESULT <key> <target ids>\n<lattice>\n
+//   PHONES <key> <source ids>\n                     -> RESULT <key> <target ids>\n<lattice>\n
+//   RELOAD <lex-filename>\n                         -> RELOADED\n\n
+// Observations without any path are answered with "EMPTY <key>" and errors
+// with "ERROR <message>", both followed by an empty block.
+void ServeClient(int fd, ModelHolder *models, const DecipherOptions &opts, float power) {
+  LineSocket connection(fd);
+  fst::ThreeWayComposition<fst::StdArc> workspace;
+  std::string line;
+  while (connection.ReadLine(&line)) {
+    std::istringstream header(line);
+    std::string command, argument;
+    header >> command >> argument;
+
+    std::string response;
+    try {
+      if (command == "DECODE" || command == "PHONES") {
+        fst::StdVectorFst observation_fst;
+        if (command == "DECODE") {
+          std::string block;
+          if (!connection.ReadBlock(&block)) {
+            return;
+          }
+          FstFromText(block, &observation_fst);
+        } else {
+          std::vector<kaldi::int32> phones;
+          kaldi::int32 phone;
+          while (header >> phone) {
+            phones.push_back(phone);
+          }
+          fst::MakeLinearAcceptor(phones, &observation_fst);
+        }
+        fst::ArcSort(&observation_fst, fst::OLabelCompare<fst::StdArc>());
+
+        std::shared_ptr<const DeciphermentModel> model = models->Get();
+        std::vector<fst::StdVectorFst> chunks(1, observation_fst);
+        fst::StdVectorFst deciphered_fst, output_fst;
+        std::vector<kaldi::int32> tgt_sequence;
+        DeciphermentStats stats;
+        if (DecipherChunks(*model, chunks, opts, &deciphered_fst, &stats, &workspace) &&
+            MakeDecipherOutput(opts, &deciphered_fst, &tgt_sequence, &output_fst)) {
+          std::ostringstream os;
+          os << "RESULT " << argument;
+          for (kaldi::int32 symbol: tgt_sequence) {
+            os << " " << symbol;
+          }
+          response = os.str() + "\n" + FstToText(output_fst) + "\n";
+          KALDI_VLOG(1) << argument << " decoded in " << stats.compose_time << " seconds";
+        } else {
+          response = "EMPTY " + argument + "\n\n";
+        }
+      } else if (command == "RELOAD") {
+        models->Reload(argument, power);
+        KALDI_LOG << "Reloaded lex model from " << argument;
+        response = "RELOADED\n\n";
+      } else {
+        response = "ERROR unknown command " + command + "\n\n";
+      }
+    } catch (const std::exception &e) {
+      KALDI_WARN << "Failed to handle " << command << " " << argument << ": " << e.what();
+      response = "ERROR " + command + " " + argument + " failed\n\n";
+    }
+
+    if (!connection.Write(response)) {
+      return;
+    }
+  }
+}
+
+
+int main(int argc, char *argv[]) {
+  try {
+    using namespace kaldi;
+    using namespace fst;
+    typedef kaldi::int32 int32;
+
+    const char *usage =
+        "Keeps decipherment models loaded and decodes observations sent over a Unix socket.\n"
+        "See decipherment-client for a client.\n"
+        "\n"
+        "Usage:\n"
+        " decipherment-server [options] <lex-filename> <ali-filename> <lm-filename> <socket-path>\n";
+
+    float power = 2.5;
+    DeciphermentModelOptions model_opts;
+    int num_threads = 4;
+    int max_pending_connections = 64;
+    DecipherOptions opts;
+
+    ParseOptions po(usage);
+    po.Register("power", &power, "Power p for P(S|T)^p");
+    po.Register("sort_states", &model_opts.sort_states, "Renumber the states of lex∘ali and the LM breadth-first for memory locality");
+    po.Register("push_lm", &model_opts.push_lm, "Push LM weights towards the start state");
+    po.Register("lm_lookahead", &model_opts.lm_lookahead, "Add the best LM cost to a final state to the search priorities, "
+                "which allows a tighter prune_beam");
+    po.Register("prune_beam", &opts.prune_beam, "Prune beam");
+    po.Register("output_prune_beam", &opts.output_prune_beam, "Output prune beam");
+    po.Register("steps_threshold", &opts.steps_threshold, "Steps threshold");
+    po.Register("prune_output", &opts.prune_output, "Prune output");
+    po.Register("remove_weights", &opts.remove_weights, "Remove weights");
+    po.Register("compose_threads", &opts.compose_threads, "Number of threads expanding each observation position within one utterance.  "
+                "Above 1, the states of a position are pruned with the prune beam against the best of them instead of "
+                "by the search queue, so --steps_threshold is not used and lattices differ from those of a single thread");
+    po.Register("num_threads", &num_threads, "Number of clients served concurrently");
+    po.Register("max_pending_connections", &max_pending_connections, "Number of accepted connections waiting for a thread");
+    po.Read(argc, argv);
+
+    if (po.NumArgs() != 4) {
+      po.PrintUsage();
+      exit(1);
+    }
+
+    std::string lex_fst_filename = po.GetArg(1),
+        ali_fst_filename = po.GetArg(2),
+        lm_fst_filename = po.GetArg(3),
+        socket_path = po.GetArg(4);
+
+    Timer load_timer;
+    ModelHolder models(std::make_shared<DeciphermentModel>(lex_fst_filename, ali_fst_filename, lm_fst_filename, power, model_opts));
+    KALDI_LOG << "Loaded models in " << load_timer.Elapsed() << " seconds";
+
+    if (max_pending_connections < 1) {
+      KALDI_ERR << "--max_pending_connections must be at least 1";
+    }
+
+    int listen_fd = LineSocket::Listen(socket_path, max_pending_connections);
+    if (listen_fd < 0) {
+      KALDI_ERR << "Could not listen on " << socket_path;
+    }
+    KALDI_LOG << "Listening on " << socket_path;
+
+    BoundedQueue<int> connections(max_pending_connections);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < num_threads; i++) {
+      workers.push_back(std::thread([&connections, &models, &opts, power] {
+        int fd;
+        while (connections.Pop(&fd)) {
+          ServeClient(fd, &models, opts, power);
+        }
+      }));
+    }
+
+    while (true) {
+      int fd = accept(listen_fd, NULL, NULL);
+      if (fd < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        KALDI_WARN << "Failed to accept connection, shutting down";
+        break;
+      }
+      if (!connections.Push(fd)) {
+        close(fd);
+        break;
+      }
+    }
+
+    connections.Close();
+    for (auto &worker: workers) {
+      worker.join();
+    }
+    close(listen_fd);
+    unlink(socket_path.c_str());
+
+    return 0;
+  } catch(const std::exception &e) {
+    std::cerr << e.what();
+    return -1;
+  }
+}
@@ -0,0 +1,62 @@
+#ifndef DECIPHERMENT_STATS_H_
+#define DECIPHERMENT_STATS_H_
+
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Counters collected by the composers and the E-step for a single utterance.
+// Times are in seconds.
+struct DeciphermentStats {
+
+  int64_t states_expanded, arcs_added, queue_updates, beam_prunes, matcher_misses;
+  double compose_time, forward_backward_time, accumulate_time;
+  // Compositions repeated with a wider beam.
+  int64_t compose_retries;
+
+  DeciphermentStats() {
+    Reset();
+  }
+
+  void Reset() {
+    states_expanded = arcs_added = queue_updates = beam_prunes = matcher_misses = 0;
+    compose_time = forward_backward_time = accumulate_time = 0;
+    compose_retries = 0;
+  }
+
+  void Add(const DeciphermentStats &other) {
+    states_expanded += other.states_expanded;
+    arcs_added += other.arcs_added;
+    queue_updates += other.queue_updates;
+    beam_prunes += other.beam_prunes;
+    matcher_misses += other.matcher_misses;
+    compose_time += other.compose_time;
+    forward_backward_time += other.forward_backward_time;
+    accumulate_time += other.accumulate_time;
+    compose_retries += other.compose_retries;
+  }
+
+  // Same order as the fields, which is what the profile wspecifiers write.
+  std::vector<double> ToVector() const {
+    return {
+      static_cast<double>(states_expanded), static_cast<double>(arcs_added),
+      static_cast<double>(queue_updates), static_cast<double>(beam_prunes),
+      static_cast<double>(matcher_misses), compose_time, forward_backward_time, accumulate_time,
+      static_cast<double>(compose_retries)
+    };
+  }
+
+  std::string ToString() const {
+    std::ostringstream os;
+    os << "states-expanded " << states_expanded << " arcs-added " << arcs_added
+       << " queue-updates " << queue_updates << " beam-prunes " << beam_prunes
+       << " matcher-misses " << matcher_misses << " compose " << compose_time
+       << "s forward-backward " << forward_backward_time << "s accumulate " << accumulate_time << "s"
+       << " compose-retries " << compose_retries;
+    return os.str();
+  }
+
+};
+
+#endif  // DECIPHERMENT_STATS_H_
@@ -0,0 +1,265 @@
+#ifndef DECIPHERMENT_DECODER_H_
+#define DECIPHERMENT_DECODER_H_
+
+#include <memory>
+
+#include "base/kaldi-common.h"
+#include "fstext/fstext-utils.h"
+#include "fstext/kaldi-fst-io.h"
+#include "threeway_compose.h"
+#include "decipherment-stats.h"
+#include "state-order.h"
+#include "separable-scores.h"
+
+struct DecipherOptions {
+  float prune_beam;
+  int steps_threshold;
+  float output_prune_beam;
+  bool prune_output;
+  bool remove_weights;
+  bool chunk_carry_state;
+  int compose_threads;
+
+  DecipherOptions(): prune_beam(8), steps_threshold(5), output_prune_beam(4), prune_output(true),
+                     remove_weights(true), chunk_carry_state(false), compose_threads(1) {}
+};
+
+// How DeciphermentModel prepares the models when loading them.
+struct DeciphermentModelOptions {
+  // Renumber the states of lex∘ali and the LM breadth-first for locality
+  // (see state-order.h).
+  bool sort_states;
+  // Push the LM weights towards the start state, so that LM costs are paid
+  // as early as possible in the search.
+  bool push_lm;
+  // Add the best cost to the end of the LM to the priority of every state
+  // of the search (see ComputeLookaheadPotentials).
+  bool lm_lookahead;
+  // Also keep lex∘ali and the LM in the lattice semiring, with the lex cost
+  // as value2, for decoding with separable scores (see separable-scores.h).
+  bool separable_scores;
+
+  DeciphermentModelOptions(): sort_states(false), push_lm(false), lm_lookahead(false), separable_scores(false) {}
+};
+
+// Models used for decoding: lex^power composed with ali, and the LM.  The ali
+// and LM fsts are shared, so that a model with a new lex fst can be created
+// without reading them again.
+class DeciphermentModel {
+
+  public:
+    DeciphermentModel(const std::string &lex_fst_filename, const std::string &ali_fst_filename,
+                      const std::string &lm_fst_filename, float power,
+                      const DeciphermentModelOptions &opts = DeciphermentModelOptions())
+        : ali_fst_(fst::ReadFstKaldi(ali_fst_filename)), opts_(opts) {
+      fst::StdVectorFst *lm_fst = fst::ReadFstKaldi(lm_fst_filename);
+      if (opts_.push_lm) {
+        fst::Push(lm_fst, fst::REWEIGHT_TO_INITIAL);
+      }
+      if (opts_.sort_states) {
+        SortStatesBreadthFirst(lm_fst);
+      }
+      lm_fst_.reset(lm_fst);
+      if (opts_.separable_scores) {
+        std::shared_ptr<fst::VectorFst<kaldi::LatticeArc>> lm_lattice = std::make_shared<fst::VectorFst<kaldi::LatticeArc>>();
+        fst::ArcMap(*lm_fst_, lm_lattice.get(), StdToLatticeMapper(false));
+        lm_lattice_ = lm_lattice;
+      }
+
+      if (opts_.lm_lookahead) {
+        std::shared_ptr<std::vector<float>> lm_potentials = std::make_shared<std::vector<float>>();
+        fst::ComputeLookaheadPotentials(*lm_fst_, lm_potentials.get());
+        lm_potentials_ = lm_potentials;
+      }
+      SetLex(lex_fst_filename, power);
+    }
+
+    DeciphermentModel(const DeciphermentModel &other, const std::string &lex_fst_filename, float power)
+        : ali_fst_(other.ali_fst_), lm_fst_(other.lm_fst_), lm_lattice_(other.lm_lattice_),
+          lm_potentials_(other.lm_potentials_), opts_(other.opts_) {
+      SetLex(lex_fst_filename, power);
+    }
+
+    float Power() const {
+      return power_;
+    }
+
+    const fst::StdVectorFst &LaFst() const {
+      return la_fst_;
+    }
+
+    const fst::StdVectorFst &LmFst() const {
+      return *lm_fst_;
+    }
+
+    const fst::DenseMatcher<fst::StdArc> &LaMatcher() const {
+      return *la_matcher_;
+    }
+
+    // The lattice versions exist only with separable scores.
+    const fst::VectorFst<kaldi::LatticeArc> &LaLattice() const {
+      return la_lattice_;
+    }
+
+    const fst::VectorFst<kaldi::LatticeArc> &LmLattice() const {
+      return *lm_lattice_;
+    }
+
+    const fst::DenseMatcher<kaldi::LatticeArc> &LaLatticeMatcher() const {
+      return *la_lattice_matcher_;
+    }
+
+    // NULL without LM lookahead.
+    const std::vector<float> *LmPotentials() const {
+      return lm_potentials_.get();
+    }
+
+  private:
+    void SetLex(const std::string &lex_fst_filename, float power) {
+      power_ = power;
+      std::unique_ptr<fst::StdVectorFst> lex_fst(fst::ReadFstKaldi(lex_fst_filename));
+      fst::ArcMap(lex_fst.get(), fst::PowerMapper<fst::StdArc>(power));
+      fst::Compose(*lex_fst, *ali_fst_, &la_fst_);
+      if (opts_.sort_states) {
+        SortStatesBreadthFirst(&la_fst_);
+      }
+      la_matcher_.reset(new fst::DenseMatcher<fst::StdArc>(la_fst_));
+
+      if (opts_.separable_scores) {
+        fst::VectorFst<kaldi::LatticeArc> lex_lattice, ali_lattice;
+        fst::ArcMap(*lex_fst, &lex_lattice, StdToLatticeMapper(true));
+        fst::ArcMap(*ali_fst_, &ali_lattice, StdToLatticeMapper(false));
+        fst::Compose(lex_lattice, ali_lattice, &la_lattice_);
+        if (opts_.sort_states) {
+          SortStatesBreadthFirst(&la_lattice_);
+        }
+        la_lattice_matcher_.reset(new fst::DenseMatcher<kaldi::LatticeArc>(la_lattice_));
+      }
+    }
+
+    std::shared_ptr<const fst::StdVectorFst> ali_fst_, lm_fst_;
+    std::shared_ptr<const fst::VectorFst<kaldi::LatticeArc>> lm_lattice_;
+    std::shared_ptr<const std::vector<float>> lm_potentials_;
+    DeciphermentModelOptions opts_;
+    float power_;
+    fst::StdVectorFst la_fst_;
+    std::unique_ptr<fst::DenseMatcher<fst::StdArc>> la_matcher_;
+    fst::VectorFst<kaldi::LatticeArc> la_lattice_;
+    std::unique_ptr<fst::DenseMatcher<kaldi::LatticeArc>> la_lattice_matcher_;
+
+};
+
+// Deciphers the chunks of one observation and concatenates the results.
+// When LM state carries over, each chunk starts from the lex/ali and LM states
+// in which the best path of the previous chunk ended, and only the state of
+// the previous chunk with that tuple stays final before concatenating, since
+// the other final states of a partial composition may be in any LM state.
+// Returns false if any
+// chunk has no complete path.  The compositions are built in workspace,
+// which a thread keeps for all of its observations.
+template <class Arc>
+bool DecipherChunks(
+    const std::vector<fst::VectorFst<Arc>> &chunks, const fst::VectorFst<Arc> &la_fst,
+    const fst::DenseMatcher<Arc> &la_matcher, const fst::VectorFst<Arc> &lm_fst,
+    const std::vector<float> *lm_potentials, const DecipherOptions &opts,
+    fst::VectorFst<Arc> *deciphered_fst, DeciphermentStats *stats, fst::ThreeWayComposition<Arc> *workspace
+) {
+  fst::ThreeWayComposeOptions compose_opts(opts.steps_threshold, opts.prune_beam, -1);
+  compose_opts.num_threads = opts.compose_threads;
+  compose_opts.potentials3 = lm_potentials;
+  for (size_t i = 0; i < chunks.size(); i++) {
+    compose_opts.partial = opts.chunk_carry_state && i + 1 < chunks.size();
+    kaldi::Timer timer;
+    fst::ThreeWayComposition<Arc> &tc = *workspace;
+    tc.Compose(chunks[i], la_fst, lm_fst, la_matcher, compose_opts);
+    DeciphermentStats chunk_stats = tc.GetStats();
+    chunk_stats.compose_time = timer.Elapsed();
+    stats->Add(chunk_stats);
+
+    fst::ThreeWayComposeStateTuple<typename Arc::StateId> tuple = tc.GetBestFinalTuple();
+    if (tuple.StateId1() == fst::kNoStateId) {
+      return false;
+    }
+
+    const fst::VectorFst<Arc> *chunk_fst = &tc.GetFst();
+    fst::VectorFst<Arc> carried_fst;
+    if (compose_opts.partial) {
+      carried_fst = tc.GetFst();
+      typename Arc::StateId best_final_state = tc.GetBestFinalState();
+      for (fst::StateIterator<fst::VectorFst<Arc>> siter(carried_fst); !siter.Done(); siter.Next()) {
+        if (siter.Value() != best_final_state) {
+          carried_fst.SetFinal(siter.Value(), Arc::Weight::Zero());
+        }
+      }
+      fst::Connect(&carried_fst);
+      chunk_fst = &carried_fst;
+    }
+
+    if (i == 0) {
+      *deciphered_fst = *chunk_fst;
+    } else {
+      fst::Concat(deciphered_fst, *chunk_fst);
+    }
+
+    if (opts.chunk_carry_state) {
+      compose_opts.start2 = tuple.StateId2();
+      compose_opts.start3 = tuple.StateId3();
+    }
+  }
+
+  return true;
+}
+
+inline bool DecipherChunks(
+    const DeciphermentModel &model, const std::vector<fst::StdVectorFst> &chunks,
+    const DecipherOptions &opts, fst::StdVectorFst *deciphered_fst, DeciphermentStats *stats,
+    fst::ThreeWayComposition<fst::StdArc> *workspace
+) {
+  return DecipherChunks(chunks, model.LaFst(), model.LaMatcher(), model.LmFst(), model.LmPotentials(),
+                        opts, deciphered_fst, stats, workspace);
+}
+
+// Deciphers with separable scores; the model must have been loaded with
+// separable_scores.
+inline bool DecipherChunks(
+    const DeciphermentModel &model, const std::vector<fst::StdVectorFst> &chunks,
+    const DecipherOptions &opts, kaldi::Lattice *deciphered_lattice, DeciphermentStats *stats,
+    fst::ThreeWayComposition<kaldi::LatticeArc> *workspace
+) {
+  std::vector<kaldi::Lattice> lattice_chunks(chunks.size());
+  for (size_t i = 0; i < chunks.size(); i++) {
+    fst::ArcMap(chunks[i], &lattice_chunks[i], StdToLatticeMapper(false));
+  }
+  return DecipherChunks(lattice_chunks, model.LaLattice(), model.LaLatticeMatcher(), model.LmLattice(),
+                        model.LmPotentials(), opts, deciphered_lattice, stats, workspace);
+}
+
+// Finds the target sequence on the best path of a deciphered fst and turns
+// the fst into the output lattice over target symbols.  Returns false if the
+// best path is empty.
+inline bool MakeDecipherOutput(
+    const DecipherOptions &opts, fst::StdVectorFst *deciphered_fst,
+    std::vector<kaldi::int32> *tgt_sequence, fst::StdVectorFst *output_fst
+) {
+  fst::StdVectorFst shortest_path;
+  fst::ShortestPath(*deciphered_fst, &shortest_path);
+  tgt_sequence->clear();
+  fst::GetLinearSymbolSequence<fst::StdArc, kaldi::int32>(shortest_path, NULL, tgt_sequence, NULL);
+  if (tgt_sequence->empty()) {
+    return false;
+  }
+
+  if (opts.prune_output) {
+    fst::Prune(deciphered_fst, opts.output_prune_beam);
+  }
+  fst::Project(deciphered_fst, fst::PROJECT_OUTPUT);
+  if (opts.remove_weights) {
+    fst::RemoveWeights(deciphered_fst);
+  }
+  fst::RmEpsilon(deciphered_fst);
+  fst::Determinize(*deciphered_fst, output_fst);
+  fst::Minimize(output_fst);
+  return true;
+}
+
+#endif  // DECIPHERMENT_DECODER_H_
@@ -0,0 +1,48 @@
+#include "base/kaldi-common.h"
+#include "util/common-utils.h"
+#include "fst/fstlib.h"
+#include "expectations.h"
+
+
+int main(int argc, char *argv[]) {
+  try {
+    using namespace kaldi;
+    typedef kaldi::int32 int32;
+
+    const char *usage =
+        "Sums expectations written by decipherment-learn, reading one input at a time.\n"
+        "\n"
+        "Usage:\n"
+        " expectations-sum [options] <expectations-out> <expectations-in1> <expectations-in2> ...\n";
+
+    bool binary = true;
+
+    ParseOptions po(usage);
+    po.Register("binary", &binary, "Write output in binary mode");
+    po.Read(argc, argv);
+
+    if (po.NumArgs() < 2) {
+      po.PrintUsage();
+      exit(1);
+    }
+
+    std::string expectations_wxfilename = po.GetArg(1);
+
+    Expectations<fst::LogArc> expectations;
+    for (int i = 2; i <= po.NumArgs(); i++) {
+      bool binary_in;
+      Input ki(po.GetArg(i), &binary_in);
+      expectations.Read(ki.Stream(), binary_in, /*add=*/i > 2);
+    }
+
+    Output ko(expectations_wxfilename, binary);
+    expectations.Write(ko.Stream(), binary);
+
+    KALDI_LOG << "Summed " << po.NumArgs() - 1 << " expectations, likelihood " << expectations.Likelihood()
+              << ", written to " << expectations_wxfilename;
+    return 0;
+  } catch(const std::exception &e) {
+    std::cerr << e.what();
+    return -1;
+  }
+}
@@ -0,0 +1,114 @@
+#include <random>
+
+#include "base/kaldi-common.h"
+#include "fstext/fstext-utils.h"
+#include "decipherment-cascade.h"
+#include "synthetic-models.h"
+
+using fst::LogArc;
+
+// Adds the same long run of small posteriors to a log accumulator and to a
+// linear one, then compares the likelihoods and every probability that
+// MaximizeLex and MaximizeAli give.
+void TestLinearSums() {
+  const int num_src_syms = 6, num_tgt_syms = 5, num_ali_states = 2, num_lex_states = 1;
+  const int num_observations = 200000;
+  const double tolerance = 1e-4;
+
+  Expectations<LogArc> expectations(num_src_syms, num_tgt_syms, num_ali_states, num_lex_states),
+      linear_expectations(num_src_syms, num_tgt_syms, num_ali_states, num_lex_states);
+  expectations.Reset(1000);
+  linear_expectations.Reset(1000);
+  Expectations<LogArc> task_expectations(num_src_syms, num_tgt_syms, num_ali_states, num_lex_states);
+  Expectations<LogArc> linear_task_expectations =
+      Expectations<LogArc>::Linear(num_src_syms, num_tgt_syms, num_ali_states, num_lex_states);
+
+  std::mt19937 rng(0);
+  std::uniform_int_distribution<int> src_dist(1, num_src_syms - 1), tgt_dist(1, num_tgt_syms - 1), ali_dist(0, num_ali_states - 1);
+  std::uniform_real_distribution<float> gamma_dist(2.0, 8.0);
+  for (int i = 0; i < num_observations; i++) {
+    // Label 1 stands for an epsilon, which makes insertions and deletions.
+    int ilabel = src_dist(rng) == 1 ? 0 : src_dist(rng), olabel = tgt_dist(rng) == 1 ? 0 : tgt_dist(rng);
+    int ali_state = ali_dist(rng);
+    LogArc::Weight gamma(gamma_dist(rng));
+    task_expectations.AddObservation(0, ali_state, ilabel, olabel, gamma);
+    linear_task_expectations.AddObservation(0, ali_state, ilabel, olabel, gamma);
+    if (i % 1000 == 0) {
+      task_expectations.AddLikelihood(gamma);
+      linear_task_expectations.AddLikelihood(gamma);
+    }
+  }
+  expectations.Add(task_expectations);
+  linear_expectations.Add(linear_task_expectations);
+
+  double likelihood = expectations.Likelihood().Value(),
+      linear_likelihood = linear_expectations.Likelihood().Value();
+  KALDI_ASSERT(fabs(likelihood - linear_likelihood) <= tolerance * std::max(1.0, fabs(likelihood)));
+
+  for (int src = 2; src < num_src_syms; src++) {
+    for (int tgt = 2; tgt <= num_tgt_syms; tgt++) {
+      double prob = exp(-expectations.MaximizeLex(0, src, tgt).Value()),
+          linear_prob = exp(-linear_expectations.MaximizeLex(0, src, tgt).Value());
+      KALDI_ASSERT(prob > 0 && fabs(prob - linear_prob) <= tolerance);
+    }
+  }
+
+  for (int state = 0; state < num_ali_states; state++) {
+    const int ali_arcs[3][2] = {{0, 2}, {num_tgt_syms, 0}, {2, 2}};
+    for (const auto &arc: ali_arcs) {
+      double prob = exp(-expectations.MaximizeAli(state, arc[0], arc[1]).Value()),
+          linear_prob = exp(-linear_expectations.MaximizeAli(state, arc[0], arc[1]).Value());
+      KALDI_ASSERT(prob > 0 && fabs(prob - linear_prob) <= tolerance);
+    }
+  }
+}
+
+// The check of decipherment-benchmark --validate-linear: one accumulator
+// for all observations of a synthetic task, as for a single job of
+// decipherment-learn, and the models maximised from either.
+void TestLinearModels() {
+  const int num_src_syms = 12, num_tgt_syms = 10;
+  const double tolerance = 1e-3;
+
+  std::mt19937 rng(1);
+  fst::VectorFst<LogArc> lex_fst, ali_fst, lm_fst;
+  MakeSyntheticLexFst(num_src_syms, num_tgt_syms, &rng, &lex_fst);
+  MakeSyntheticAliFst(num_tgt_syms, 2, 0.1, 2, 0.1, &ali_fst);
+  MakeSyntheticLmFst(num_tgt_syms, 4, &rng, &lm_fst);
+
+  ThreewayComposer<LogArc> composer(lex_fst, ali_fst, lm_fst, 8, 5);
+  DeciphermentCascade<LogArc> cascade(true, true, &lex_fst, &ali_fst), linear_cascade(true, true, &lex_fst, &ali_fst);
+  Expectations<LogArc> expectations(num_src_syms, num_tgt_syms, ali_fst.NumStates(), lex_fst.NumStates()),
+      linear_expectations(num_src_syms, num_tgt_syms, ali_fst.NumStates(), lex_fst.NumStates());
+  expectations.Reset(1000);
+  linear_expectations.Reset(1000);
+  Expectations<LogArc> task_expectations(num_src_syms, num_tgt_syms, ali_fst.NumStates(), lex_fst.NumStates());
+  Expectations<LogArc> linear_task_expectations =
+      Expectations<LogArc>::Linear(num_src_syms, num_tgt_syms, ali_fst.NumStates(), lex_fst.NumStates());
+
+  Composition<LogArc> workspace;
+  for (int i = 0; i < 10; i++) {
+    fst::VectorFst<LogArc> observation;
+    MakeSyntheticObservation(num_src_syms, 20, 2, 0.05, &rng, &observation);
+    cascade.ComputeExpectations(composer, observation, task_expectations, NULL, 1, &workspace);
+    cascade.ComputeExpectations(composer, observation, linear_task_expectations, NULL, 1, &workspace);
+  }
+  expectations.Add(task_expectations);
+  linear_expectations.Add(linear_task_expectations);
+  cascade.Maximize(expectations);
+  linear_cascade.Maximize(linear_expectations);
+
+  double likelihood = expectations.Likelihood().Value(),
+      linear_likelihood = linear_expectations.Likelihood().Value();
+  KALDI_ASSERT(likelihood != 0);
+  KALDI_ASSERT(fabs(likelihood - linear_likelihood) <= tolerance * std::max(1.0, fabs(likelihood)));
+  KALDI_ASSERT(MaxProbabilityDifference(cascade.LexFst(), linear_cascade.LexFst()) <= tolerance);
+  KALDI_ASSERT(MaxProbabilityDifference(cascade.AliFst(), linear_cascade.AliFst()) <= tolerance);
+}
+
+int main() {
+  TestLinearSums();
+  TestLinearModels();
+  std::cout << "Test OK.\n";
+  return 0;
+}
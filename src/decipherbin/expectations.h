@@ -1,6 +1,11 @@
 #ifndef DECIPHERMENT_EXPECTATIONS_H_
 #define DECIPHERMENT_EXPECTATIONS_H_
 
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "base/io-funcs.h"
 #include "table.h"
 
 template <class Arc>
@@ -16,17 +21,43 @@ class Expectations {
         int num_src_syms, int num_tgt_syms, int num_ali_states, int num_lex_states
     ): num_src_syms_(num_src_syms),
        num_tgt_syms_(num_tgt_syms),
+       num_ali_states_(num_ali_states),
+       num_lex_states_(num_lex_states),
        total_likelihood_(Log64Weight::One()),
+       prior_(Log64Weight::Zero()),
        ali_expectations_(num_ali_states, 3, Log64Weight::Zero()),
        ali_expectations_sum_(num_ali_states, Log64Weight::Zero()),
        lex_expectations_(num_lex_states, num_src_syms, num_tgt_syms + 1, Log64Weight::Zero()),
-       lex_expectations_sum_(num_lex_states, num_tgt_syms + 1, Log64Weight::Zero()) {}
+       lex_expectations_sum_(num_lex_states, num_tgt_syms + 1, Log64Weight::Zero()),
+       linear_(false),
+       ali_probs_(0, 0.0),
+       lex_probs_(0, 0.0) {}
+
+    // Empty accumulator to Read into.
+    Expectations(): Expectations(0, 0, 0, 0) {}
+
+    // Accumulator for the observations of one task, which keeps probabilities
+    // rather than log weights, as double sums of the same size, and leaves
+    // the sums over targets and sources to Add.  AddObservation then costs
+    // two additions instead of four log-adds.  Posteriors below the smallest
+    // double, about exp(-745), are lost.  It can only be added to a log
+    // accumulator, where it is turned into log weights.
+    static Expectations Linear(int num_src_syms, int num_tgt_syms, int num_ali_states, int num_lex_states) {
+      Expectations expectations(num_src_syms, num_tgt_syms, 0, 0);
+      expectations.num_ali_states_ = num_ali_states;
+      expectations.num_lex_states_ = num_lex_states;
+      expectations.linear_ = true;
+      expectations.ali_probs_ = Table<double>(num_ali_states, 3, 0.0);
+      expectations.lex_probs_ = Table<double>(num_lex_states, num_src_syms, num_tgt_syms + 1, 0.0);
+      return expectations;
+    }
 
     void Reset(Log64Weight constant = Log64Weight::Zero()) {
+      prior_ = constant;
       ali_expectations_.SetToConstant(constant);
-      ali_expectations_sum_.SetToConstant(constant.Value() + log(3));
+      ali_expectations_sum_.SetToConstant(AliSumPrior(constant));
       lex_expectations_.SetToConstant(constant);
-      lex_expectations_sum_.SetToConstant(constant.Value() + log(num_src_syms_ - 2));
+      lex_expectations_sum_.SetToConstant(LexSumPrior(constant));
     }
 
     void AddLikelihood(Weight likelihood) {
@@ -40,6 +71,20 @@ class Expectations {
         return;
       }
 
+      if (linear_) {
+        double prob = exp(-static_cast<double>(gamma.Value()));
+        if (ilabel == 0) {
+          ali_probs_(ali_state, INSERTION) += prob;
+        } else if (olabel == 0) {
+          ali_probs_(ali_state, DELETION) += prob;
+          lex_probs_(lex_state, ilabel, num_tgt_syms_) += prob;
+        } else {
+          ali_probs_(ali_state, MATCH) += prob;
+          lex_probs_(lex_state, ilabel, olabel) += prob;
+        }
+        return;
+      }
+
       bool is_insertion = ilabel == 0;
       if (is_insertion) {
         ali_expectations_(ali_state, INSERTION) = fst::Plus(ali_expectations_(ali_state, INSERTION), to_log64(gamma));
@@ -99,17 +144,167 @@ class Expectations {
       return from_log64(fst::Divide(lex_expectations_(state, ilabel, olabel), lex_expectations_sum_(state, olabel)));
     }
 
+    // Drops lex expectations whose probability P(src|tgt) is below
+    // posterior_floor or which are not among the top_k targets of their source
+    // symbol, and renormalises the rest, so that MaximizeLex gives zero to the
+    // dropped ones and Maximize removes their arcs.  The most likely source of
+    // every target is always kept, and so are deletions, which neither count
+    // towards top_k nor are floored, as in prune_lexical_model.py.  Either
+    // criterion is off when 0.
+    void SparsifyLex(double posterior_floor, int top_k) {
+      const Label deletion = num_tgt_syms_;
+      std::vector<std::vector<double>> probs(num_src_syms_, std::vector<double>(num_tgt_syms_ + 1, 0.0));
+      std::vector<double> top_probs;
+      for (StateId state = 0; state < num_lex_states_; state++) {
+        std::vector<double> best_probs(num_tgt_syms_ + 1, 0.0);
+        for (Label src = 2; src < num_src_syms_; src++) {
+          for (Label tgt = 2; tgt < deletion; tgt++) {
+            bool is_sum_zero = lex_expectations_sum_(state, tgt) == Log64Weight::Zero();
+            probs[src][tgt] = is_sum_zero ? 0.0 : exp(-fst::Divide(lex_expectations_(state, src, tgt), lex_expectations_sum_(state, tgt)).Value());
+            best_probs[tgt] = std::max(best_probs[tgt], probs[src][tgt]);
+          }
+        }
+
+        for (Label src = 2; src < num_src_syms_; src++) {
+          double threshold = posterior_floor;
+          if (top_k > 0 && top_k < deletion - 2) {
+            top_probs.assign(probs[src].begin() + 2, probs[src].begin() + deletion);
+            std::nth_element(top_probs.begin(), top_probs.begin() + top_k - 1, top_probs.end(), std::greater<double>());
+            threshold = std::max(threshold, top_probs[top_k - 1]);
+          }
+
+          for (Label tgt = 2; tgt < deletion; tgt++) {
+            if (probs[src][tgt] < threshold && probs[src][tgt] < best_probs[tgt]) {
+              lex_expectations_(state, src, tgt) = Log64Weight::Zero();
+            }
+          }
+        }
+
+        for (Label tgt = 2; tgt < deletion; tgt++) {
+          Log64Weight sum = Log64Weight::Zero();
+          for (Label src = 1; src < num_src_syms_; src++) {
+            sum = fst::Plus(sum, lex_expectations_(state, src, tgt));
+          }
+          lex_expectations_sum_(state, tgt) = sum;
+        }
+      }
+    }
+
     Weight LexOccupationCount(StateId state, Label ilabel, Label olabel) const {
       return from_log64(lex_expectations_(state, ilabel, olabel));
     }
 
     void Add(const Expectations &other) {
+      KALDI_ASSERT(!linear_);
+      if (other.linear_) {
+        AddLinear(other);
+        return;
+      }
+
       auto lambda = [](const Log64Weight &a, const Log64Weight &b) { return fst::Plus(a, b); };
       ali_expectations_.Add(other.ali_expectations_, lambda);
       ali_expectations_sum_.Add(other.ali_expectations_sum_, lambda);
       lex_expectations_.Add(other.lex_expectations_, lambda);
       lex_expectations_sum_.Add(other.lex_expectations_sum_, lambda);
       total_likelihood_ = fst::Times(total_likelihood_, other.total_likelihood_);
+      prior_ = fst::Plus(prior_, other.prior_);
+    }
+
+    // Replaces the expectations with self_weight times them plus other_weight
+    // times those of other, the update of stepwise EM.  The log-likelihoods
+    // are interpolated with the same weights, so that the likelihood stays a
+    // running estimate, per observation when other_weight divides by the size
+    // of the batch, instead of growing with every update.
+    void Interpolate(const Expectations &other, double self_weight, double other_weight) {
+      if (other.num_src_syms_ != num_src_syms_ || other.num_tgt_syms_ != num_tgt_syms_ ||
+          other.num_ali_states_ != num_ali_states_ || other.num_lex_states_ != num_lex_states_) {
+        KALDI_ERR << "Cannot interpolate expectations of different sizes";
+      }
+
+      Log64Weight self_scale(-log(self_weight)), other_scale(-log(other_weight));
+      auto lambda = [self_scale, other_scale](const Log64Weight &a, const Log64Weight &b) {
+        return fst::Plus(fst::Times(a, self_scale), fst::Times(b, other_scale));
+      };
+      ali_expectations_.Add(other.ali_expectations_, lambda);
+      ali_expectations_sum_.Add(other.ali_expectations_sum_, lambda);
+      lex_expectations_.Add(other.lex_expectations_, lambda);
+      lex_expectations_sum_.Add(other.lex_expectations_sum_, lambda);
+      total_likelihood_ = Log64Weight((self_weight != 0 ? self_weight * total_likelihood_.Value() : 0) +
+                                      (other_weight != 0 ? other_weight * other.total_likelihood_.Value() : 0));
+      prior_ = lambda(prior_, other.prior_);
+    }
+
+    // Writes the sizes, the likelihood and the constant of the last Reset,
+    // followed by the entries of every table that differ from their value
+    // after that Reset, as (index, weight) pairs in index order.
+    void Write(std::ostream &os, bool binary) const {
+      kaldi::WriteToken(os, binary, "<Expectations>");
+      kaldi::WriteToken(os, binary, "<Version>");
+      kaldi::WriteBasicType(os, binary, kVersion);
+      kaldi::WriteToken(os, binary, "<Dims>");
+      kaldi::WriteBasicType(os, binary, num_src_syms_);
+      kaldi::WriteBasicType(os, binary, num_tgt_syms_);
+      kaldi::WriteBasicType(os, binary, num_ali_states_);
+      kaldi::WriteBasicType(os, binary, num_lex_states_);
+      kaldi::WriteToken(os, binary, "<Likelihood>");
+      kaldi::WriteBasicType(os, binary, total_likelihood_.Value());
+      kaldi::WriteToken(os, binary, "<Prior>");
+      kaldi::WriteBasicType(os, binary, prior_.Value());
+      WriteTable(os, binary, "<Ali>", ali_expectations_, prior_);
+      WriteTable(os, binary, "<AliSum>", ali_expectations_sum_, AliSumPrior(prior_));
+      WriteTable(os, binary, "<Lex>", lex_expectations_, prior_);
+      WriteTable(os, binary, "<LexSum>", lex_expectations_sum_, LexSumPrior(prior_));
+      kaldi::WriteToken(os, binary, "</Expectations>");
+    }
+
+    // Replaces the accumulator with the one in is, or with add, adds it to
+    // this one.  Entries are added as they are read, so summing many
+    // accumulators only ever holds one of them in memory.
+    void Read(std::istream &is, bool binary, bool add = false) {
+      kaldi::ExpectToken(is, binary, "<Expectations>");
+      kaldi::ExpectToken(is, binary, "<Version>");
+      int version;
+      kaldi::ReadBasicType(is, binary, &version);
+      if (version != kVersion) {
+        KALDI_ERR << "Unsupported expectations version " << version;
+      }
+
+      int num_src_syms, num_tgt_syms, num_ali_states, num_lex_states;
+      kaldi::ExpectToken(is, binary, "<Dims>");
+      kaldi::ReadBasicType(is, binary, &num_src_syms);
+      kaldi::ReadBasicType(is, binary, &num_tgt_syms);
+      kaldi::ReadBasicType(is, binary, &num_ali_states);
+      kaldi::ReadBasicType(is, binary, &num_lex_states);
+      if (add && (num_src_syms != num_src_syms_ || num_tgt_syms != num_tgt_syms_ ||
+                  num_ali_states != num_ali_states_ || num_lex_states != num_lex_states_)) {
+        KALDI_ERR << "Cannot add expectations of different sizes";
+      }
+
+      if (!add) {
+        num_src_syms_ = num_src_syms;
+        num_tgt_syms_ = num_tgt_syms;
+        num_ali_states_ = num_ali_states;
+        num_lex_states_ = num_lex_states;
+        total_likelihood_ = Log64Weight::One();
+        ali_expectations_ = Table<Log64Weight>(num_ali_states, 3, Log64Weight::Zero());
+        ali_expectations_sum_ = Table<Log64Weight>(num_ali_states, Log64Weight::Zero());
+        lex_expectations_ = Table<Log64Weight>(num_lex_states, num_src_syms, num_tgt_syms + 1, Log64Weight::Zero());
+        lex_expectations_sum_ = Table<Log64Weight>(num_lex_states, num_tgt_syms + 1, Log64Weight::Zero());
+      }
+
+      double likelihood, prior;
+      kaldi::ExpectToken(is, binary, "<Likelihood>");
+      kaldi::ReadBasicType(is, binary, &likelihood);
+      kaldi::ExpectToken(is, binary, "<Prior>");
+      kaldi::ReadBasicType(is, binary, &prior);
+      total_likelihood_ = fst::Times(total_likelihood_, Log64Weight(likelihood));
+
+      ReadTable(is, binary, "<Ali>", Log64Weight(prior), add, &ali_expectations_);
+      ReadTable(is, binary, "<AliSum>", AliSumPrior(Log64Weight(prior)), add, &ali_expectations_sum_);
+      ReadTable(is, binary, "<Lex>", Log64Weight(prior), add, &lex_expectations_);
+      ReadTable(is, binary, "<LexSum>", LexSumPrior(Log64Weight(prior)), add, &lex_expectations_sum_);
+      kaldi::ExpectToken(is, binary, "</Expectations>");
+      prior_ = add ? fst::Plus(prior_, Log64Weight(prior)) : Log64Weight(prior);
     }
 
     Weight Likelihood() {
@@ -117,13 +312,114 @@ class Expectations {
     }
 
   private:
-    const int INSERTION = 0;
-    const int DELETION = 1;
-    const int MATCH = 2;
+    static const int kVersion = 1;
+
+    static Log64Weight FromProb(double prob) {
+      return prob > 0 ? Log64Weight(-log(prob)) : Log64Weight::Zero();
+    }
+
+    // Adds the sums of a linear accumulator.
+    void AddLinear(const Expectations &other) {
+      for (StateId state = 0; state < num_ali_states_; state++) {
+        double sum = 0;
+        for (int kind = 0; kind < 3; kind++) {
+          double prob = other.ali_probs_(state, kind);
+          ali_expectations_(state, kind) = fst::Plus(ali_expectations_(state, kind), FromProb(prob));
+          sum += prob;
+        }
+        ali_expectations_sum_(state) = fst::Plus(ali_expectations_sum_(state), FromProb(sum));
+      }
+
+      std::vector<double> sums(num_tgt_syms_ + 1);
+      for (StateId state = 0; state < num_lex_states_; state++) {
+        std::fill(sums.begin(), sums.end(), 0.0);
+        for (Label src = 0; src < num_src_syms_; src++) {
+          for (Label tgt = 0; tgt <= num_tgt_syms_; tgt++) {
+            double prob = other.lex_probs_(state, src, tgt);
+            if (prob > 0) {
+              lex_expectations_(state, src, tgt) = fst::Plus(lex_expectations_(state, src, tgt), FromProb(prob));
+              sums[tgt] += prob;
+            }
+          }
+        }
+        for (Label tgt = 0; tgt <= num_tgt_syms_; tgt++) {
+          lex_expectations_sum_(state, tgt) = fst::Plus(lex_expectations_sum_(state, tgt), FromProb(sums[tgt]));
+        }
+      }
+
+      total_likelihood_ = fst::Times(total_likelihood_, other.total_likelihood_);
+    }
+
+    Log64Weight AliSumPrior(Log64Weight prior) const {
+      return prior.Value() + log(3);
+    }
+
+    Log64Weight LexSumPrior(Log64Weight prior) const {
+      return prior.Value() + log(num_src_syms_ - 2);
+    }
+
+    static void WriteTable(
+        std::ostream &os, bool binary, const char *token, const Table<Log64Weight> &table, Log64Weight prior
+    ) {
+      kaldi::int64 num_entries = 0;
+      for (size_t i = 0; i < table.Size(); i++) {
+        num_entries += (table(i) != prior) ? 1 : 0;
+      }
+
+      kaldi::WriteToken(os, binary, token);
+      kaldi::WriteBasicType(os, binary, num_entries);
+      for (size_t i = 0; i < table.Size(); i++) {
+        if (table(i) != prior) {
+          kaldi::WriteBasicType(os, binary, static_cast<kaldi::int64>(i));
+          kaldi::WriteBasicType(os, binary, table(i).Value());
+        }
+      }
+    }
+
+    // Entries missing from the stream have the value prior.  When adding a
+    // stream whose prior is not zero, every entry of the table changes.
+    static void ReadTable(
+        std::istream &is, bool binary, const char *token, Log64Weight prior, bool add, Table<Log64Weight> *table
+    ) {
+      kaldi::ExpectToken(is, binary, token);
+      kaldi::int64 num_entries;
+      kaldi::ReadBasicType(is, binary, &num_entries);
+      if (!add) {
+        table->SetToConstant(prior);
+      }
+
+      bool add_prior = add && prior != Log64Weight::Zero();
+      size_t next = 0;
+      for (kaldi::int64 e = 0; e < num_entries; e++) {
+        kaldi::int64 index;
+        double value;
+        kaldi::ReadBasicType(is, binary, &index);
+        kaldi::ReadBasicType(is, binary, &value);
+        if (index < static_cast<kaldi::int64>(next) || index >= static_cast<kaldi::int64>(table->Size())) {
+          KALDI_ERR << "Bad index " << index << " in " << token;
+        }
+
+        for (; add_prior && next < static_cast<size_t>(index); next++) {
+          (*table)(next) = fst::Plus((*table)(next), prior);
+        }
+        (*table)(index) = add ? fst::Plus((*table)(index), Log64Weight(value)) : Log64Weight(value);
+        next = index + 1;
+      }
+
+      for (; add_prior && next < table->Size(); next++) {
+        (*table)(next) = fst::Plus((*table)(next), prior);
+      }
+    }
+
+    static const int INSERTION = 0;
+    static const int DELETION = 1;
+    static const int MATCH = 2;
 
-    int num_src_syms_, num_tgt_syms_;
-    Log64Weight total_likelihood_;
+    int num_src_syms_, num_tgt_syms_, num_ali_states_, num_lex_states_;
+    Log64Weight total_likelihood_, prior_;
     Table<Log64Weight> ali_expectations_, ali_expectations_sum_, lex_expectations_, lex_expectations_sum_;
+    bool linear_;
+    Table<double> ali_probs_, lex_probs_;
     fst::WeightConvert<Weight, Log64Weight> to_log64;
     fst::WeightConvert<Log64Weight, Weight> from_log64;
 
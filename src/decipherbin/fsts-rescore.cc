@@ -27,6 +27,7 @@
 #include "fstext/table-matcher.h"
 #include "fstext/fstext-utils.h"
 #include "fstext/kaldi-fst-io.h"
+#include "benchmark-utils.h"
 
 int main(int argc, char *argv[]) {
   try {
@@ -51,10 +52,12 @@ int main(int argc, char *argv[]) {
     float output_prune_beam = 4;
     bool prune_output = true;
     bool remove_weights = true;
+    std::string utt2dur_rspecifier;
     po.Register("phi-label", &phi_label, "If >0, the label on backoff arcs of the LM");
     po.Register("output_prune_beam", &output_prune_beam, "Output prune beam");
     po.Register("prune_output", &prune_output, "Prune output");
     po.Register("remove_weights", &remove_weights, "Remove weights");
+    po.Register("utt2dur-rspecifier", &utt2dur_rspecifier, "If set, read utterance durations to report the real-time factor, e.g. ark,t:data/utt2dur");
     po.Read(argc, argv);
 
     if (po.NumArgs() != 5) {
@@ -71,6 +74,7 @@ int main(int argc, char *argv[]) {
         fst_wspecifier = po.GetArg(5);
     int32 n_done = 0, n_fail = 0;
 
+    Timer load_timer;
     SequentialTableReader<VectorFstHolder> fst_reader(fst_rspecifier);
     Int32VectorWriter target_writer(target_wspecifier);
     TableWriter<VectorFstHolder> fst_writer(fst_wspecifier);
@@ -91,7 +95,16 @@ int main(int argc, char *argv[]) {
     PropagateFinal(phi_label, old_lm_fst);
     PropagateFinal(phi_label, new_lm_fst);
 
+    ThroughputStats throughput_stats;
+    throughput_stats.SetLoadTime(load_timer.Elapsed());
+    RandomAccessBaseFloatReader utt2dur_reader;
+    if (!utt2dur_rspecifier.empty() && !utt2dur_reader.Open(utt2dur_rspecifier)) {
+      KALDI_ERR << "Could not open utt2dur rspecifier " << utt2dur_rspecifier;
+    }
+
+    Timer decode_timer;
     for (; !fst_reader.Done(); fst_reader.Next()) {
+      Timer utterance_timer;
       std::string key = fst_reader.Key();
       VectorFst<StdArc> fst = fst_reader.Value();
       fst::OLabelCompare<StdArc> olabel_comp;
@@ -129,7 +142,11 @@ int main(int argc, char *argv[]) {
         KALDI_LOG << key << " is empty";
         n_fail++;
       }
+
+      double duration = (utt2dur_reader.IsOpen() && utt2dur_reader.HasKey(key)) ? utt2dur_reader.Value(key) : 0;
+      throughput_stats.AddUtterance(utterance_timer.Elapsed(), duration);
     }
+    KALDI_LOG << "Throughput " << throughput_stats.Report(decode_timer.Elapsed());
 
     KALDI_LOG << "Done " << n_done << " fsts; failed for "
               << n_fail;
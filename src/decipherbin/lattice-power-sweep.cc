@@ -0,0 +1,77 @@
+#include <memory>
+
+#include "base/kaldi-common.h"
+#include "util/common-utils.h"
+#include "lat/kaldi-lattice.h"
+#include "fstext/fstext-utils.h"
+
+int main(int argc, char *argv[]) {
+  try {
+    using namespace kaldi;
+    typedef kaldi::int32 int32;
+
+    const char *usage =
+        "Picks the best target sequence for each of a list of powers from the separable lattices\n"
+        "written by decipherment-apply --separable_lattice_wspecifier, whose paths cost\n"
+        "graph cost + power * acoustic cost.  The lattices were pruned at the power they were\n"
+        "decoded with, so powers far from it only choose among the paths that survived.\n"
+        "\n"
+        "Usage: lattice-power-sweep [options] <powers> <lattice-rspecifier> <target-wspecifier-1> ... <target-wspecifier-n>\n"
+        " e.g.: lattice-power-sweep 1.5,2,2.5 ark:lat.1.ark ark,t:tgt.1.5 ark,t:tgt.2 ark,t:tgt.2.5\n";
+
+    ParseOptions po(usage);
+    po.Read(argc, argv);
+
+    if (po.NumArgs() < 3) {
+      po.PrintUsage();
+      exit(1);
+    }
+
+    std::string powers_str = po.GetArg(1),
+        lattice_rspecifier = po.GetArg(2);
+    std::vector<float> powers;
+    if (!SplitStringToFloats(powers_str, ",", false, &powers) || powers.empty()) {
+      KALDI_ERR << "Invalid powers " << powers_str;
+    }
+    if (po.NumArgs() != 2 + static_cast<int>(powers.size())) {
+      KALDI_ERR << "Expected " << powers.size() << " target wspecifiers, one per power, got " << po.NumArgs() - 2;
+    }
+
+    std::vector<std::unique_ptr<Int32VectorWriter>> target_writers;
+    for (size_t i = 0; i < powers.size(); i++) {
+      target_writers.emplace_back(new Int32VectorWriter(po.GetArg(3 + i)));
+    }
+
+    int32 n_done = 0, n_fail = 0;
+    SequentialLatticeReader lattice_reader(lattice_rspecifier);
+    for (; !lattice_reader.Done(); lattice_reader.Next()) {
+      std::string key = lattice_reader.Key();
+      const Lattice &lattice = lattice_reader.Value();
+      bool empty = false;
+      for (size_t i = 0; i < powers.size(); i++) {
+        Lattice scaled_lattice(lattice);
+        fst::ScaleLattice(fst::LatticeScale(1.0, powers[i]), &scaled_lattice);
+        Lattice shortest_path;
+        fst::ShortestPath(scaled_lattice, &shortest_path);
+
+        std::vector<int32> tgt_sequence;
+        fst::GetLinearSymbolSequence<LatticeArc, int32>(shortest_path, NULL, &tgt_sequence, NULL);
+        empty = empty || tgt_sequence.empty();
+        target_writers[i]->Write(key, tgt_sequence);
+      }
+
+      if (empty) {
+        KALDI_LOG << key << " is empty";
+        n_fail++;
+      } else {
+        n_done++;
+      }
+    }
+
+    KALDI_LOG << "Done " << n_done << " lattices for " << powers.size() << " powers; failed for " << n_fail;
+    return (n_done != 0 ? 0 : 1);
+  } catch(const std::exception &e) {
+    std::cerr << e.what();
+    return -1;
+  }
+}
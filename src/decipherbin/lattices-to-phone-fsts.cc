@@ -6,23 +6,66 @@
 #include "lat/lattice-functions.h"
 #include "lat/sausages.h"
 #include "util/common-utils.h"
+#include "util/kaldi-thread.h"
+#include "phone-sausage.h"
 
 
+// Runs MBR on one lattice and writes its sausage fst once the tasks started
+// before it are written, so that the output is in input order.
+class SausageTask {
+  public:
+    SausageTask(
+        const std::string &key,
+        const kaldi::CompactLattice &clat,
+        const std::vector<std::vector<double> > *scale,
+        const kaldi::MinimumBayesRiskOptions *mbr_opts,
+        const PhoneSausageOptions *sausage_opts,
+        kaldi::TableWriter<fst::VectorFstHolder> *fst_writer,
+        int *num_done
+    ): key_(key), clat_(clat), scale_(scale), mbr_opts_(mbr_opts), sausage_opts_(sausage_opts),
+       fst_writer_(fst_writer), num_done_(num_done) {}
+
+  void operator() () {
+    LatticeToSausageFst(*scale_, *mbr_opts_, *sausage_opts_, &clat_, &fst_);
+  }
+
+  ~SausageTask() {
+    KALDI_LOG << "Processed " << key_ << " with " << fst::NumArcs(fst_) << " arcs";
+    fst_writer_->Write(key_, fst_);
+    (*num_done_)++;
+  }
+
+ private:
+  std::string key_;
+  kaldi::CompactLattice clat_;
+  const std::vector<std::vector<double> > *scale_;
+  const kaldi::MinimumBayesRiskOptions *mbr_opts_;
+  const PhoneSausageOptions *sausage_opts_;
+  kaldi::TableWriter<fst::VectorFstHolder> *fst_writer_;
+  int *num_done_;
+  fst::StdVectorFst fst_;
+};
+
 int main(int argc, char *argv[]) {
   try {
     using namespace kaldi;
     using kaldi::int32;
 
-    const char *usage = "";
+    const char *usage =
+        "Turn lattices into phone sausage fsts by MBR decoding\n"
+        "Usage: lattices-to-phone-fsts [options] <lattice-rspecifier> <fst-wspecifier>\n";
     ParseOptions po(usage);
 
     BaseFloat acoustic_scale = 0.1;
     BaseFloat lm_scale = 1.0;
-    BaseFloat sausage_mass_threshold = 0.9;
+    int num_threads = 1;
     
     po.Register("acoustic-scale", &acoustic_scale, "Scaling factor for acoustic likelihoods");
     po.Register("lm-scale", &lm_scale, "Scaling factor for graph/lm costs");
-    po.Register("sausage-mass-threshold", &sausage_mass_threshold, "Sausage mass threshold");
+    po.Register("num-threads", &num_threads, "Number of lattices processed in parallel");
+
+    PhoneSausageOptions sausage_opts;
+    sausage_opts.Register(&po);
     
     MinimumBayesRiskOptions mbr_opts;
     mbr_opts.Register(&po);
@@ -42,43 +85,14 @@ int main(int argc, char *argv[]) {
 
     int32 num_done = 0, num_err = 0;
     std::vector<std::vector<double> > scale = fst::LatticeScale(lm_scale, acoustic_scale);
-    for (; !clat_reader.Done(); clat_reader.Next()) {
-      std::string key = clat_reader.Key();
-      KALDI_LOG << "Processing " << key;
-      CompactLattice &clat = clat_reader.Value();
-      ScaleLattice(scale, &clat);
-
-      MinimumBayesRisk mbr(clat, mbr_opts);
-      const auto &sausages = mbr.GetSausageStats();
-
-      fst::StdVectorFst fst;
-      fst.AddState();
-      fst.SetStart(0);
-      int last_state = 0;
-      for (const auto &sausage: sausages) {
-        if (sausage.size() == 1 && sausage[0].first == 0) {
-          continue;
-        }
-
-        fst.AddState();
-        last_state++;
-
-        float sum = 0;
-        for (const auto &arc: sausage) {
-          fst::StdArc::Weight weight(-log(arc.second));
-          fst.AddArc(last_state - 1, fst::StdArc(arc.first, arc.first, weight, last_state));
-
-          sum += arc.second;
-          if (sum >= sausage_mass_threshold) {
-            break;
-          }
-        }
+    TaskSequencerConfig config;
+    config.num_threads = num_threads;
+    {
+      TaskSequencer<SausageTask> sequencer(config);
+      for (; !clat_reader.Done(); clat_reader.Next()) {
+        sequencer.Run(new SausageTask(clat_reader.Key(), clat_reader.Value(), &scale, &mbr_opts, &sausage_opts, &fst_writer, &num_done));
       }
-      fst.SetFinal(last_state, 0);
-      
-      KALDI_LOG << "Processed " << key;
-      fst_writer.Write(key, fst); 
-      num_done++;
+      sequencer.Wait();
     }
 
     KALDI_LOG << "Successfully aligned " << num_done << " lattices; "
@@ -0,0 +1,129 @@
+#ifndef DECIPHERMENT_LEXICAL_MODEL_H_
+#define DECIPHERMENT_LEXICAL_MODEL_H_
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "fst/fstlib.h"
+
+// Operations on single-state lexical models P(source|target) between training
+// stages, ported from local/decipherment/prune_lexical_model.py and
+// smooth_lexical_model.py.  Arc weights are read as -log probabilities, so
+// they work the same for tropical and log arcs.  Source symbol 1 and target
+// symbol 1 are silence, num_tgt_syms is the deletion symbol.
+
+namespace lexical_model_internal {
+
+// Probabilities indexed by [src][tgt], zero where the model has no arc.
+template <class Arc>
+std::vector<std::vector<double>> GetLexProbabilities(
+    const fst::VectorFst<Arc> &lex_fst, int num_src_syms, int num_tgt_syms
+) {
+  std::vector<std::vector<double>> probs(num_src_syms, std::vector<double>(num_tgt_syms + 1, 0.0));
+  for (fst::StateIterator<fst::VectorFst<Arc>> siter(lex_fst); !siter.Done(); siter.Next()) {
+    for (fst::ArcIterator<fst::VectorFst<Arc>> aiter(lex_fst, siter.Value()); !aiter.Done(); aiter.Next()) {
+      const Arc &arc = aiter.Value();
+      if (arc.ilabel > 0 && arc.ilabel < num_src_syms && arc.olabel > 0 && arc.olabel <= num_tgt_syms) {
+        probs[arc.ilabel][arc.olabel] = exp(-arc.weight.Value());
+      }
+    }
+  }
+  return probs;
+}
+
+template <class Arc>
+void StartLexFst(fst::VectorFst<Arc> *ofst) {
+  ofst->DeleteStates();
+  ofst->AddState();
+  ofst->SetStart(0);
+  ofst->SetFinal(0, Arc::Weight::One());
+  ofst->AddArc(0, Arc(1, 1, Arc::Weight::One(), 0));
+}
+
+// Value of the keep-th largest non-zero probability, or of the smallest one if
+// there are fewer.
+inline double TopKThreshold(std::vector<double> values, int keep) {
+  values.erase(std::remove(values.begin(), values.end(), 0.0), values.end());
+  if (values.empty()) {
+    return 0.0;
+  }
+  keep = std::min<int>(keep, values.size());
+  std::nth_element(values.begin(), values.begin() + keep - 1, values.end(), std::greater<double>());
+  return values[keep - 1];
+}
+
+}  // namespace lexical_model_internal
+
+// Keeps an arc if it is among the keep_top most likely targets of its source
+// symbol or the keep_top most likely sources of its target symbol, and
+// renormalises the kept arcs per target symbol.  Deletions are always kept.
+template <class Arc>
+void PruneLexicalModel(
+    const fst::VectorFst<Arc> &lex_fst, int num_src_syms, int num_tgt_syms, int keep_top,
+    fst::VectorFst<Arc> *ofst
+) {
+  using namespace lexical_model_internal;
+  using Weight = typename Arc::Weight;
+  std::vector<std::vector<double>> probs = GetLexProbabilities(lex_fst, num_src_syms, num_tgt_syms);
+
+  std::vector<double> src_thresholds(num_src_syms, 0.0);
+  for (int src = 2; src < num_src_syms; src++) {
+    src_thresholds[src] = TopKThreshold(probs[src], keep_top);
+  }
+
+  std::vector<double> tgt_thresholds(num_tgt_syms + 1, 0.0);
+  for (int tgt = 2; tgt < num_tgt_syms; tgt++) {
+    std::vector<double> column(num_src_syms);
+    for (int src = 2; src < num_src_syms; src++) {
+      column[src] = probs[src][tgt];
+    }
+    tgt_thresholds[tgt] = TopKThreshold(column, keep_top);
+  }
+
+  std::vector<double> prob_sum(num_tgt_syms + 1, 0.0);
+  for (int src = 2; src < num_src_syms; src++) {
+    for (int tgt = 2; tgt <= num_tgt_syms; tgt++) {
+      double prob = probs[src][tgt];
+      if (prob > 0 && (prob >= src_thresholds[src] || prob >= tgt_thresholds[tgt])) {
+        prob_sum[tgt] += prob;
+      } else {
+        probs[src][tgt] = 0.0;
+      }
+    }
+  }
+
+  StartLexFst(ofst);
+  for (int src = 2; src < num_src_syms; src++) {
+    for (int tgt = 2; tgt <= num_tgt_syms; tgt++) {
+      if (probs[src][tgt] > 0) {
+        ofst->AddArc(0, Arc(src, tgt, Weight(-log(probs[src][tgt] / prob_sum[tgt])), 0));
+      }
+    }
+  }
+  fst::ArcSort(ofst, fst::OLabelCompare<Arc>());
+}
+
+// Interpolates the model with a uniform distribution over source symbols:
+// alpha * P(src|tgt) + (1 - alpha) / (num_src_syms - 1), which gives every
+// source/target pair an arc again.
+template <class Arc>
+void SmoothLexicalModel(
+    const fst::VectorFst<Arc> &lex_fst, int num_src_syms, int num_tgt_syms, float alpha,
+    fst::VectorFst<Arc> *ofst
+) {
+  using namespace lexical_model_internal;
+  using Weight = typename Arc::Weight;
+  std::vector<std::vector<double>> probs = GetLexProbabilities(lex_fst, num_src_syms, num_tgt_syms);
+
+  StartLexFst(ofst);
+  double uniform = (1 - alpha) / (num_src_syms - 1);
+  for (int src = 2; src < num_src_syms; src++) {
+    for (int tgt = 2; tgt <= num_tgt_syms; tgt++) {
+      ofst->AddArc(0, Arc(src, tgt, Weight(-log(uniform + alpha * probs[src][tgt])), 0));
+    }
+  }
+  fst::ArcSort(ofst, fst::OLabelCompare<Arc>());
+}
+
+#endif  // DECIPHERMENT_LEXICAL_MODEL_H_
@@ -0,0 +1,64 @@
+#include <sys/socket.h>
+
+#include "base/kaldi-common.h"
+#include "fstext/fstext-utils.h"
+#include "line-socket.h"
+
+// Linear fst over labels with weights that survive the text form exactly.
+fst::StdVectorFst MakeTestFst(const std::vector<kaldi::int32> &ilabels, const std::vector<kaldi::int32> &olabels) {
+  fst::StdVectorFst ofst;
+  ofst.AddState();
+  ofst.SetStart(0);
+  for (size_t i = 0; i < ilabels.size(); i++) {
+    ofst.AddState();
+    ofst.AddArc(i, fst::StdArc(ilabels[i], olabels[i], 0.25 * (i + 1), i + 1));
+  }
+  ofst.SetFinal(ilabels.size(), 0.5);
+  return ofst;
+}
+
+void TestFstToText() {
+  KALDI_ASSERT(FstToText(fst::StdVectorFst()).empty());
+
+  std::string text = FstToText(MakeTestFst({3, 5}, {3, 5}));
+  KALDI_ASSERT(!text.empty() && text.front() != '\n' && text.back() == '\n');
+  KALDI_ASSERT(text.find("\n\n") == std::string::npos);
+}
+
+// One DECODE request and its RESULT reply, as exchanged by
+// decipherment-client and decipherment-server, followed by an EMPTY reply
+// that has to be read as the next message.
+void TestRoundTrip() {
+  int fds[2];
+  KALDI_ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  LineSocket client(fds[0]), server(fds[1]);
+
+  fst::StdVectorFst observation_fst = MakeTestFst({3, 5, 4}, {3, 5, 4});
+  KALDI_ASSERT(client.Write("DECODE utt1\n" + FstToText(observation_fst) + "\n"));
+
+  std::string header, block;
+  KALDI_ASSERT(server.ReadLine(&header) && header == "DECODE utt1");
+  KALDI_ASSERT(server.ReadBlock(&block) && !block.empty());
+  fst::StdVectorFst received_fst;
+  FstFromText(block, &received_fst);
+  KALDI_ASSERT(fst::Equal(observation_fst, received_fst));
+
+  fst::StdVectorFst output_fst = MakeTestFst({7, 8}, {7, 8});
+  KALDI_ASSERT(server.Write("RESULT utt1 7 8\n" + FstToText(output_fst) + "\n"));
+  KALDI_ASSERT(server.Write("EMPTY utt2\n\n"));
+
+  KALDI_ASSERT(client.ReadLine(&header) && header == "RESULT utt1 7 8");
+  KALDI_ASSERT(client.ReadBlock(&block));
+  FstFromText(block, &received_fst);
+  KALDI_ASSERT(fst::Equal(output_fst, received_fst));
+
+  KALDI_ASSERT(client.ReadLine(&header) && header == "EMPTY utt2");
+  KALDI_ASSERT(client.ReadBlock(&block) && block.empty());
+}
+
+int main() {
+  TestFstToText();
+  TestRoundTrip();
+  std::cout << "Test OK.\n";
+  return 0;
+}
@@ -0,0 +1,148 @@
+#ifndef DECIPHERMENT_LINE_SOCKET_H_
+#define DECIPHERMENT_LINE_SOCKET_H_
+
+#include <cstring>
+#include <sstream>
+#include <string>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "fstext/kaldi-fst-io.h"
+
+// Line-oriented connection over a Unix domain socket, used by
+// decipherment-server and decipherment-client.  A message is a header line
+// followed by a block of lines terminated by an empty line, which is also how
+// Kaldi writes fsts in text form.
+class LineSocket {
+
+  public:
+    explicit LineSocket(int fd): fd_(fd), begin_(0), end_(0) {}
+
+    ~LineSocket() {
+      if (fd_ >= 0) {
+        close(fd_);
+      }
+    }
+
+    // Returns -1 on failure.
+    static int Connect(const std::string &path) {
+      sockaddr_un address;
+      if (!MakeAddress(path, &address)) {
+        return -1;
+      }
+
+      int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+      }
+      return fd;
+    }
+
+    // Returns -1 on failure.  Removes a stale socket file at path.
+    static int Listen(const std::string &path, int backlog) {
+      sockaddr_un address;
+      if (!MakeAddress(path, &address)) {
+        return -1;
+      }
+
+      unlink(path.c_str());
+      int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (fd >= 0 && (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(fd, backlog) != 0)) {
+        close(fd);
+        return -1;
+      }
+      return fd;
+    }
+
+    // Reads a line without the trailing newline; returns false at the end of
+    // the stream.
+    bool ReadLine(std::string *line) {
+      line->clear();
+      while (true) {
+        for (; begin_ < end_; begin_++) {
+          if (buffer_[begin_] == '\n') {
+            begin_++;
+            return true;
+          }
+          line->push_back(buffer_[begin_]);
+        }
+
+        ssize_t size = read(fd_, buffer_, sizeof(buffer_));
+        if (size <= 0) {
+          return false;
+        }
+        begin_ = 0;
+        end_ = size;
+      }
+    }
+
+    // Reads lines up to an empty line, keeping their newlines.
+    bool ReadBlock(std::string *block) {
+      block->clear();
+      std::string line;
+      while (ReadLine(&line)) {
+        if (line.empty()) {
+          return true;
+        }
+        block->append(line);
+        block->push_back('\n');
+      }
+      return false;
+    }
+
+    bool Write(const std::string &data) {
+      size_t written = 0;
+      while (written < data.size()) {
+        ssize_t size = send(fd_, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+        if (size <= 0) {
+          return false;
+        }
+        written += size;
+      }
+      return true;
+    }
+
+  private:
+    static bool MakeAddress(const std::string &path, sockaddr_un *address) {
+      if (path.size() >= sizeof(address->sun_path)) {
+        return false;
+      }
+      memset(address, 0, sizeof(*address));
+      address->sun_family = AF_UNIX;
+      strncpy(address->sun_path, path.c_str(), sizeof(address->sun_path) - 1);
+      return true;
+    }
+
+    LineSocket(const LineSocket &) = delete;
+    LineSocket &operator=(const LineSocket &) = delete;
+
+    int fd_;
+    char buffer_[65536];
+    size_t begin_, end_;
+
+};
+
+// Fst in Kaldi text form as a block of lines: an empty fst is an empty block.
+// WriteFstKaldi starts text output with a newline, for the key of an archive
+// line, which would end the block at once, so it is dropped too.
+inline std::string FstToText(const fst::StdVectorFst &fst) {
+  std::ostringstream os;
+  fst::WriteFstKaldi(os, false, fst);
+  std::string text = os.str();
+  size_t begin = text.find_first_not_of('\n');
+  if (begin == std::string::npos) {
+    return "";
+  }
+  size_t end = text.find_last_not_of('\n');
+  return text.substr(begin, end + 1 - begin) + "\n";
+}
+
+inline void FstFromText(const std::string &block, fst::StdVectorFst *fst) {
+  std::istringstream is(block);
+  fst::ReadFstKaldi(is, false, fst);
+}
+
+#endif  // DECIPHERMENT_LINE_SOCKET_H_
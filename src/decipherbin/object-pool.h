@@ -0,0 +1,36 @@
+#ifndef DECIPHERMENT_OBJECT_POOL_H_
+#define DECIPHERMENT_OBJECT_POOL_H_
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Objects handed out to tasks and taken back when they are done, so that
+// tasks running on a fixed number of threads share as many objects as there
+// are threads.  Acquire creates a new object if none is free.
+template <class T>
+class ObjectPool {
+
+  public:
+    std::unique_ptr<T> Acquire() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (objects_.empty()) {
+        return std::unique_ptr<T>(new T());
+      }
+      std::unique_ptr<T> object = std::move(objects_.back());
+      objects_.pop_back();
+      return object;
+    }
+
+    void Release(std::unique_ptr<T> object) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      objects_.push_back(std::move(object));
+    }
+
+  private:
+    std::vector<std::unique_ptr<T>> objects_;
+    std::mutex mutex_;
+
+};
+
+#endif  // DECIPHERMENT_OBJECT_POOL_H_
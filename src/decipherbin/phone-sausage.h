@@ -0,0 +1,112 @@
+#ifndef DECIPHERMENT_PHONE_SAUSAGE_H_
+#define DECIPHERMENT_PHONE_SAUSAGE_H_
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <tuple>
+#include <vector>
+
+#include "base/kaldi-common.h"
+#include "itf/options-itf.h"
+#include "fst/fstlib.h"
+#include "lat/kaldi-lattice.h"
+#include "lat/sausages.h"
+
+struct PhoneSausageOptions {
+  float mass_threshold;
+  int max_arcs_per_slot;
+  int max_arcs_per_utterance;
+
+  PhoneSausageOptions(): mass_threshold(0.9), max_arcs_per_slot(0), max_arcs_per_utterance(0) {}
+
+  void Register(kaldi::OptionsItf *opts) {
+    opts->Register("sausage-mass-threshold", &mass_threshold, "Sausage mass threshold");
+    opts->Register("max-arcs-per-slot", &max_arcs_per_slot, "If >0, keep at most this many phones per sausage slot");
+    opts->Register("max-arcs-per-utterance", &max_arcs_per_utterance, "If >0, keep at most this many arcs per utterance, "
+                   "but at least the best phone of every slot");
+  }
+};
+
+// Turns the sausage stats of MinimumBayesRisk, i.e. per slot the phones with
+// their posteriors from highest to lowest, into a layered acceptor with
+// -log(posterior) weights.  Slots holding only epsilon are dropped.  Every
+// slot keeps its phones until their mass reaches mass_threshold or there are
+// max_arcs_per_slot of them.  If that is more than max_arcs_per_utterance
+// arcs, every slot keeps its best phone and the rest of the budget goes to
+// the phones with the highest posteriors over all slots.
+inline void SausagesToFst(
+    const std::vector<std::vector<std::pair<kaldi::int32, kaldi::BaseFloat>>> &sausages,
+    const PhoneSausageOptions &opts, fst::StdVectorFst *ofst
+) {
+  // Limits of 0 or less are off.
+  const size_t max_arcs_per_slot = opts.max_arcs_per_slot > 0 ?
+      static_cast<size_t>(opts.max_arcs_per_slot) : std::numeric_limits<size_t>::max();
+  const size_t max_arcs_per_utterance = opts.max_arcs_per_utterance > 0 ?
+      static_cast<size_t>(opts.max_arcs_per_utterance) : std::numeric_limits<size_t>::max();
+
+  std::vector<const std::vector<std::pair<kaldi::int32, kaldi::BaseFloat>> *> slots;
+  std::vector<size_t> num_arcs;
+  size_t total_arcs = 0;
+  for (const auto &sausage: sausages) {
+    if (sausage.empty() || (sausage.size() == 1 && sausage[0].first == 0)) {
+      continue;
+    }
+
+    size_t n = 0;
+    float sum = 0;
+    while (n < sausage.size() && n < max_arcs_per_slot) {
+      sum += sausage[n++].second;
+      if (sum >= opts.mass_threshold) {
+        break;
+      }
+    }
+    slots.push_back(&sausage);
+    num_arcs.push_back(n);
+    total_arcs += n;
+  }
+
+  if (total_arcs > max_arcs_per_utterance) {
+    // Candidates beyond the best phone of each slot as (-posterior, rank,
+    // slot), so that the phones kept in a slot are always its best ones.
+    std::vector<std::tuple<float, size_t, size_t>> candidates;
+    for (size_t s = 0; s < slots.size(); s++) {
+      for (size_t r = 1; r < num_arcs[s]; r++) {
+        candidates.push_back(std::make_tuple(-(*slots[s])[r].second, r, s));
+      }
+      num_arcs[s] = 1;
+    }
+
+    size_t budget = (max_arcs_per_utterance > slots.size()) ? max_arcs_per_utterance - slots.size() : 0;
+    budget = std::min(budget, candidates.size());
+    std::partial_sort(candidates.begin(), candidates.begin() + budget, candidates.end());
+    for (size_t c = 0; c < budget; c++) {
+      num_arcs[std::get<2>(candidates[c])]++;
+    }
+  }
+
+  ofst->DeleteStates();
+  ofst->AddState();
+  ofst->SetStart(0);
+  for (size_t s = 0; s < slots.size(); s++) {
+    ofst->AddState();
+    for (size_t r = 0; r < num_arcs[s]; r++) {
+      const auto &arc = (*slots[s])[r];
+      fst::StdArc::Weight weight(-log(arc.second));
+      ofst->AddArc(s, fst::StdArc(arc.first, arc.first, weight, s + 1));
+    }
+  }
+  ofst->SetFinal(slots.size(), 0);
+}
+
+// Scales a lattice, runs MBR on it and turns the sausages into an fst.
+inline void LatticeToSausageFst(
+    const std::vector<std::vector<double> > &scale, const kaldi::MinimumBayesRiskOptions &mbr_opts,
+    const PhoneSausageOptions &sausage_opts, kaldi::CompactLattice *clat, fst::StdVectorFst *ofst
+) {
+  fst::ScaleLattice(scale, clat);
+  kaldi::MinimumBayesRisk mbr(*clat, mbr_opts);
+  SausagesToFst(mbr.GetSausageStats(), sausage_opts, ofst);
+}
+
+#endif  // DECIPHERMENT_PHONE_SAUSAGE_H_
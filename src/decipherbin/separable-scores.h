@@ -0,0 +1,78 @@
+#ifndef DECIPHERMENT_SEPARABLE_SCORES_H_
+#define DECIPHERMENT_SEPARABLE_SCORES_H_
+
+#include "fst/fstlib.h"
+#include "lat/kaldi-lattice.h"
+#include "lat/lattice-functions.h"
+
+// Decoding with separable scores runs the search on Kaldi lattice weights:
+// value1 holds the alignment, LM and observation costs, and value2 the lex
+// cost scaled by the power.  The search orders states by value1 + value2, so
+// it finds what the tropical search finds, but the lex cost of every path
+// can be recovered afterwards and the best path for another power picked
+// without decoding again.
+
+// Maps tropical arcs to lattice arcs, with the cost as value1 or value2.
+class StdToLatticeMapper {
+  public:
+    using FromArc = fst::StdArc;
+    using ToArc = kaldi::LatticeArc;
+
+    explicit StdToLatticeMapper(bool to_value2): to_value2_(to_value2) {}
+
+    ToArc operator()(const FromArc &arc) const {
+      ToArc::Weight weight = ToArc::Weight::Zero();
+      if (arc.weight != FromArc::Weight::Zero()) {
+        weight = to_value2_ ? ToArc::Weight(0, arc.weight.Value()) : ToArc::Weight(arc.weight.Value(), 0);
+      }
+      return ToArc(arc.ilabel, arc.olabel, weight, arc.nextstate);
+    }
+
+    fst::MapFinalAction FinalAction() const { return fst::MAP_NO_SUPERFINAL; }
+
+    fst::MapSymbolsAction InputSymbolsAction() const { return fst::MAP_COPY_SYMBOLS; }
+
+    fst::MapSymbolsAction OutputSymbolsAction() const { return fst::MAP_COPY_SYMBOLS; }
+
+    uint64 Properties(uint64 props) const { return props; }
+
+  private:
+    bool to_value2_;
+};
+
+// Maps lattice arcs back to tropical arcs with the sum of both costs.
+class LatticeToStdMapper {
+  public:
+    using FromArc = kaldi::LatticeArc;
+    using ToArc = fst::StdArc;
+
+    ToArc operator()(const FromArc &arc) const {
+      ToArc::Weight weight = ToArc::Weight::Zero();
+      if (arc.weight != FromArc::Weight::Zero()) {
+        weight = arc.weight.Value1() + arc.weight.Value2();
+      }
+      return ToArc(arc.ilabel, arc.olabel, weight, arc.nextstate);
+    }
+
+    fst::MapFinalAction FinalAction() const { return fst::MAP_NO_SUPERFINAL; }
+
+    fst::MapSymbolsAction InputSymbolsAction() const { return fst::MAP_COPY_SYMBOLS; }
+
+    fst::MapSymbolsAction OutputSymbolsAction() const { return fst::MAP_COPY_SYMBOLS; }
+
+    uint64 Properties(uint64 props) const { return props; }
+};
+
+// Turns a deciphered lattice into the separable output lattice over target
+// symbols: pruned with output_prune_beam unless beam is negative, and with
+// value2 divided by the power, so that it is the unscaled lex cost.  The cost
+// of a path for power p is then value1 + p * value2.
+inline void MakeSeparableLattice(float power, float beam, kaldi::Lattice *lattice) {
+  if (beam >= 0) {
+    kaldi::PruneLattice(beam, lattice);
+  }
+  fst::Project(lattice, fst::PROJECT_OUTPUT);
+  fst::ScaleLattice(fst::LatticeScale(1.0, 1.0 / power), lattice);
+}
+
+#endif  // DECIPHERMENT_SEPARABLE_SCORES_H_
@@ -0,0 +1,112 @@
+#ifndef DECIPHERMENT_SQUAREM_H_
+#define DECIPHERMENT_SQUAREM_H_
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <tuple>
+#include <vector>
+
+#include "fst/fstlib.h"
+
+// SQUAREM extrapolation (Varadhan & Roland, 2008) of the lexical model from
+// three consecutive EM iterates lex0, lex1 = M(lex0) and lex2 = M(lex1):
+//   r = x1 - x0, v = x2 - 2 x1 + x0, alpha = -|r| / |v|,
+//   x' = x0 - 2 alpha r + alpha^2 v
+// where x are log probabilities, so that the result stays positive, and
+// alpha = -1 gives back lex2.  alpha is kept within [-max_step, -1], since
+// nearly parallel r and v give huge steps whose models are always rejected.
+// The result is renormalised to P(source|target) for every state and target
+// symbol.  Arcs of lex2 that were pruned from lex0 or lex1 keep their lex2
+// weight.  Returns alpha.
+template <class Arc>
+double ExtrapolateLexFst(
+    const fst::VectorFst<Arc> &lex0, const fst::VectorFst<Arc> &lex1, const fst::VectorFst<Arc> &lex2,
+    fst::VectorFst<Arc> *ofst, double max_step = 4
+) {
+  using StateId = typename Arc::StateId;
+  using Label = typename Arc::Label;
+  using Weight = typename Arc::Weight;
+  using Fst = fst::VectorFst<Arc>;
+  typedef std::tuple<StateId, Label, Label> Key;
+
+  auto get_log_probs = [](const Fst &lex_fst) {
+    std::map<Key, double> log_probs;
+    for (fst::StateIterator<Fst> siter(lex_fst); !siter.Done(); siter.Next()) {
+      for (fst::ArcIterator<Fst> aiter(lex_fst, siter.Value()); !aiter.Done(); aiter.Next()) {
+        const Arc &arc = aiter.Value();
+        log_probs[Key(siter.Value(), arc.ilabel, arc.olabel)] = -arc.weight.Value();
+      }
+    }
+    return log_probs;
+  };
+
+  std::map<Key, double> x0 = get_log_probs(lex0), x1 = get_log_probs(lex1);
+  double r_norm = 0, v_norm = 0;
+  for (fst::StateIterator<Fst> siter(lex2); !siter.Done(); siter.Next()) {
+    for (fst::ArcIterator<Fst> aiter(lex2, siter.Value()); !aiter.Done(); aiter.Next()) {
+      const Arc &arc = aiter.Value();
+      Key key(siter.Value(), arc.ilabel, arc.olabel);
+      auto it0 = x0.find(key), it1 = x1.find(key);
+      if (it0 == x0.end() || it1 == x1.end()) {
+        continue;
+      }
+      double r = it1->second - it0->second;
+      double v = -arc.weight.Value() - 2 * it1->second + it0->second;
+      r_norm += r * r;
+      v_norm += v * v;
+    }
+  }
+
+  *ofst = lex2;
+  if (v_norm == 0) {
+    return -1;
+  }
+
+  double alpha = std::max(std::min(-sqrt(r_norm / v_norm), -1.0), -std::max(max_step, 1.0));
+  std::map<std::pair<StateId, Label>, double> log_sums;
+  for (fst::StateIterator<Fst> siter(*ofst); !siter.Done(); siter.Next()) {
+    StateId state = siter.Value();
+    for (fst::MutableArcIterator<Fst> aiter(ofst, state); !aiter.Done(); aiter.Next()) {
+      Arc arc = aiter.Value();
+      bool is_silence_arc = arc.ilabel == 1 && arc.olabel == 1;
+      if (is_silence_arc) {
+        continue;
+      }
+
+      double x = -arc.weight.Value();
+      auto it0 = x0.find(Key(state, arc.ilabel, arc.olabel)), it1 = x1.find(Key(state, arc.ilabel, arc.olabel));
+      if (it0 != x0.end() && it1 != x1.end()) {
+        double r = it1->second - it0->second;
+        double v = x - 2 * it1->second + it0->second;
+        x = it0->second - 2 * alpha * r + alpha * alpha * v;
+        arc.weight = Weight(-x);
+        aiter.SetValue(arc);
+      }
+
+      auto it = log_sums.find(std::make_pair(state, arc.olabel));
+      if (it == log_sums.end()) {
+        log_sums[std::make_pair(state, arc.olabel)] = x;
+      } else {
+        double high = std::max(it->second, x), low = std::min(it->second, x);
+        it->second = high + log1p(exp(low - high));
+      }
+    }
+  }
+
+  for (fst::StateIterator<Fst> siter(*ofst); !siter.Done(); siter.Next()) {
+    StateId state = siter.Value();
+    for (fst::MutableArcIterator<Fst> aiter(ofst, state); !aiter.Done(); aiter.Next()) {
+      Arc arc = aiter.Value();
+      bool is_silence_arc = arc.ilabel == 1 && arc.olabel == 1;
+      if (!is_silence_arc) {
+        arc.weight = Weight(arc.weight.Value() + log_sums[std::make_pair(state, arc.olabel)]);
+        aiter.SetValue(arc);
+      }
+    }
+  }
+
+  return alpha;
+}
+
+#endif  // DECIPHERMENT_SQUAREM_H_
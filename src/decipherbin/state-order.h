@@ -0,0 +1,48 @@
+#ifndef DECIPHERMENT_STATE_ORDER_H_
+#define DECIPHERMENT_STATE_ORDER_H_
+
+#include <vector>
+
+#include "fst/fstlib.h"
+
+// Renumbers the states of fst in breadth-first order from the start state, so
+// that states visited one after another by the three-way search, and with
+// them their arcs and DenseMatcher rows, tend to be close in memory.  States
+// that cannot be reached keep their relative order after all others.  If
+// order is not NULL, it is set to the new id of every old state.
+template <class Arc>
+void SortStatesBreadthFirst(fst::VectorFst<Arc> *ifst, std::vector<typename Arc::StateId> *order = NULL) {
+  using StateId = typename Arc::StateId;
+  std::vector<StateId> new_ids(ifst->NumStates(), fst::kNoStateId);
+  if (ifst->Start() == fst::kNoStateId) {
+    return;
+  }
+
+  std::vector<StateId> visited(1, ifst->Start());
+  new_ids[ifst->Start()] = 0;
+  for (size_t i = 0; i < visited.size(); i++) {
+    for (fst::ArcIterator<fst::VectorFst<Arc>> aiter(*ifst, visited[i]); !aiter.Done(); aiter.Next()) {
+      StateId nextstate = aiter.Value().nextstate;
+      if (new_ids[nextstate] == fst::kNoStateId) {
+        new_ids[nextstate] = visited.size();
+        visited.push_back(nextstate);
+      }
+    }
+  }
+
+  StateId next_id = visited.size();
+  for (StateId &new_id: new_ids) {
+    if (new_id == fst::kNoStateId) {
+      new_id = next_id++;
+    }
+  }
+
+  uint64_t sort_properties = ifst->Properties(fst::kILabelSorted | fst::kOLabelSorted, false);
+  fst::StateSort(ifst, new_ids);
+  ifst->SetProperties(sort_properties, fst::kILabelSorted | fst::kOLabelSorted);
+  if (order != NULL) {
+    order->swap(new_ids);
+  }
+}
+
+#endif  // DECIPHERMENT_STATE_ORDER_H_
@@ -0,0 +1,229 @@
+#ifndef DECIPHERMENT_SYNTHETIC_MODELS_H_
+#define DECIPHERMENT_SYNTHETIC_MODELS_H_
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <random>
+#include <tuple>
+#include <vector>
+
+#include "fst/fstlib.h"
+
+// Generators of random models and observations with the same shape as the
+// ones created by local/decipherment and local/lang, for benchmarks and tests.  Source
+// symbols are 1..num_src_syms-1 and target symbols are 1..num_tgt_syms-1, with
+// 1 being silence in both and num_tgt_syms being the deletion symbol.
+
+// Single-state lexical model P(source|target), like create_lexical_model.py.
+template <class Arc>
+void MakeSyntheticLexFst(int num_src_syms, int num_tgt_syms, std::mt19937 *rng, fst::VectorFst<Arc> *ofst) {
+  using Weight = typename Arc::Weight;
+  std::uniform_real_distribution<float> uniform(0.01, 1.0);
+
+  ofst->DeleteStates();
+  ofst->AddState();
+  ofst->SetStart(0);
+  ofst->SetFinal(0, Weight::One());
+  ofst->AddArc(0, Arc(1, 1, Weight::One(), 0));
+  for (int tgt = 2; tgt <= num_tgt_syms; tgt++) {
+    std::vector<float> probs(num_src_syms - 2);
+    float sum = 0;
+    for (auto &prob: probs) {
+      prob = uniform(*rng);
+      sum += prob;
+    }
+
+    for (int src = 2; src < num_src_syms; src++) {
+      ofst->AddArc(0, Arc(src, tgt, Weight(-log(probs[src - 2] / sum)), 0));
+    }
+  }
+
+  fst::ArcSort(ofst, fst::OLabelCompare<Arc>());
+}
+
+// Alignment model with insertions and deletions, like create_alignment_model.py.
+template <class Arc>
+void MakeSyntheticAliFst(
+    int num_tgt_syms, int max_insertions, float prob_insertion,
+    int max_deletions, float prob_deletion, fst::VectorFst<Arc> *ofst
+) {
+  using Weight = typename Arc::Weight;
+  int del_symbol = num_tgt_syms;
+  std::vector<int> ins_states, del_states;
+  for (int i = 0; i < max_insertions; i++) {
+    ins_states.push_back(3 + i);
+  }
+  for (int i = 0; i < max_deletions; i++) {
+    del_states.push_back(3 + max_insertions + i);
+  }
+
+  ofst->DeleteStates();
+  for (int s = 0; s < 3 + max_insertions + max_deletions; s++) {
+    ofst->AddState();
+    ofst->SetFinal(s, Weight::One());
+  }
+  ofst->SetStart(0);
+
+  ofst->AddArc(0, Arc(0, 0, Weight::One(), 1));
+  ofst->AddArc(0, Arc(1, 1, Weight::One(), 1));
+
+  for (int symbol = 2; symbol < num_tgt_syms; symbol++) {
+    Weight match(-log(1 - prob_insertion - prob_deletion));
+    ofst->AddArc(1, Arc(symbol, symbol, match, 2));
+    ofst->AddArc(2, Arc(symbol, symbol, match, 2));
+    for (int state: ins_states) {
+      Weight weight = (state != ins_states.back()) ? Weight(-log(1 - prob_insertion)) : Weight::One();
+      ofst->AddArc(state, Arc(symbol, symbol, weight, 2));
+    }
+    for (int state: del_states) {
+      Weight weight = (state != del_states.back()) ? Weight(-log(1 - prob_deletion)) : Weight::One();
+      ofst->AddArc(state, Arc(symbol, symbol, weight, 2));
+    }
+  }
+
+  for (int input_symbol: {0, 1}) {
+    ofst->AddArc(2, Arc(input_symbol, 1, Weight::One(), 1));
+    for (int state: ins_states) {
+      ofst->AddArc(state, Arc(input_symbol, 1, Weight::One(), 1));
+    }
+    for (int state: del_states) {
+      ofst->AddArc(state, Arc(input_symbol, 1, Weight::One(), 1));
+    }
+  }
+
+  int state = 2;
+  for (int next_state: del_states) {
+    ofst->AddArc(state, Arc(del_symbol, 0, Weight(-log(prob_deletion)), next_state));
+    state = next_state;
+  }
+
+  state = 2;
+  for (int next_state: ins_states) {
+    for (int symbol = 2; symbol < num_tgt_syms; symbol++) {
+      ofst->AddArc(state, Arc(0, symbol, Weight(-log(prob_insertion)), next_state));
+    }
+    state = next_state;
+  }
+
+  fst::ArcSort(ofst, fst::ILabelCompare<Arc>());
+}
+
+// Bigram acceptor over target symbols where every history allows silence and
+// branching other symbols.  State 0 is the start state and state s > 0 is the
+// history ending with symbol s + 1.
+template <class Arc>
+void MakeSyntheticLmFst(int num_tgt_syms, int branching, std::mt19937 *rng, fst::VectorFst<Arc> *ofst) {
+  using Weight = typename Arc::Weight;
+  std::uniform_real_distribution<float> uniform(0.01, 1.0);
+  std::uniform_int_distribution<int> symbols(2, num_tgt_syms - 1);
+
+  ofst->DeleteStates();
+  for (int s = 0; s < num_tgt_syms - 1; s++) {
+    ofst->AddState();
+  }
+  ofst->SetStart(0);
+
+  for (int s = 0; s < num_tgt_syms - 1; s++) {
+    std::vector<int> next_symbols;
+    std::vector<float> probs;
+    float sum = 0;
+    for (int i = 0; i < branching + 2; i++) {
+      int symbol = (i == 0) ? 1 : symbols(*rng);
+      if (std::find(next_symbols.begin(), next_symbols.end(), symbol) != next_symbols.end()) {
+        continue;
+      }
+      next_symbols.push_back(symbol);
+      probs.push_back(uniform(*rng));
+      sum += probs.back();
+    }
+
+    // The last draw is used as the end of sentence probability.
+    ofst->SetFinal(s, Weight(-log(probs.back() / sum)));
+    for (size_t i = 0; i + 1 < next_symbols.size(); i++) {
+      int next_state = (next_symbols[i] == 1) ? s : next_symbols[i] - 1;
+      ofst->AddArc(s, Arc(next_symbols[i], next_symbols[i], Weight(-log(probs[i] / sum)), next_state));
+    }
+  }
+
+  fst::ArcSort(ofst, fst::ILabelCompare<Arc>());
+}
+
+// Sausage of the given length over source symbols with width arcs per slot,
+// or a linear acceptor for width 1.  Each slot is a silence with probability
+// silence_rate.
+template <class Arc>
+void MakeSyntheticObservation(
+    int num_src_syms, int length, int width, float silence_rate,
+    std::mt19937 *rng, fst::VectorFst<Arc> *ofst
+) {
+  using Weight = typename Arc::Weight;
+  std::uniform_real_distribution<float> uniform(0.01, 1.0);
+  std::uniform_int_distribution<int> symbols(2, num_src_syms - 1);
+
+  ofst->DeleteStates();
+  ofst->AddState();
+  ofst->SetStart(0);
+  for (int slot = 0; slot < length; slot++) {
+    ofst->AddState();
+    if (uniform(*rng) < silence_rate) {
+      ofst->AddArc(slot, Arc(1, 1, Weight::One(), slot + 1));
+      continue;
+    }
+
+    std::vector<int> slot_symbols;
+    std::vector<float> probs;
+    float sum = 0;
+    while (slot_symbols.size() < width && slot_symbols.size() < num_src_syms - 2) {
+      int symbol = symbols(*rng);
+      if (std::find(slot_symbols.begin(), slot_symbols.end(), symbol) != slot_symbols.end()) {
+        continue;
+      }
+      slot_symbols.push_back(symbol);
+      probs.push_back(uniform(*rng));
+      sum += probs.back();
+    }
+
+    for (size_t i = 0; i < slot_symbols.size(); i++) {
+      Weight weight = (width == 1) ? Weight::One() : Weight(-log(probs[i] / sum));
+      ofst->AddArc(slot, Arc(slot_symbols[i], slot_symbols[i], weight, slot + 1));
+    }
+  }
+  ofst->SetFinal(length, Weight::One());
+
+  fst::ArcSort(ofst, fst::OLabelCompare<Arc>());
+}
+
+// Largest difference between the probabilities of the arcs and final weights
+// of two fsts with the same states, or infinity if their numbers of states
+// differ.  An arc missing from one of them has probability zero there, since
+// lex arcs with zero expectations are removed.
+inline double MaxProbabilityDifference(const fst::VectorFst<fst::LogArc> &fst1, const fst::VectorFst<fst::LogArc> &fst2) {
+  using namespace fst;
+  if (fst1.NumStates() != fst2.NumStates()) {
+    return std::numeric_limits<double>::infinity();
+  }
+
+  double max_difference = 0;
+  for (StateIterator<VectorFst<LogArc>> siter(fst1); !siter.Done(); siter.Next()) {
+    LogArc::StateId state = siter.Value();
+    max_difference = std::max(max_difference, fabs(exp(-fst1.Final(state).Value()) - exp(-fst2.Final(state).Value())));
+
+    std::map<std::tuple<LogArc::Label, LogArc::Label, LogArc::StateId>, std::pair<double, double>> probs;
+    for (ArcIterator<VectorFst<LogArc>> aiter(fst1, state); !aiter.Done(); aiter.Next()) {
+      const LogArc &arc = aiter.Value();
+      probs[std::make_tuple(arc.ilabel, arc.olabel, arc.nextstate)].first = exp(-arc.weight.Value());
+    }
+    for (ArcIterator<VectorFst<LogArc>> aiter(fst2, state); !aiter.Done(); aiter.Next()) {
+      const LogArc &arc = aiter.Value();
+      probs[std::make_tuple(arc.ilabel, arc.olabel, arc.nextstate)].second = exp(-arc.weight.Value());
+    }
+    for (const auto &entry: probs) {
+      max_difference = std::max(max_difference, fabs(entry.second.first - entry.second.second));
+    }
+  }
+  return max_difference;
+}
+
+#endif  // DECIPHERMENT_SYNTHETIC_MODELS_H_
@@ -27,6 +27,10 @@ class Table {
       }
     }
 
+    size_t Size() const {
+      return data_.size();
+    }
+
     void SetToConstant(const T &val) {
       std::fill(data_.begin(), data_.end(), val);
     }
@@ -1,8 +1,16 @@
 #ifndef DECIPHERMENT_THREEWAY_COMPOSE_
 #define DECIPHERMENT_THREEWAY_COMPOSE_
 
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
 #include "fstext/fstext-utils.h"
+#include "fstext/lattice-weight.h"
 #include "table.h"
+#include "decipherment-stats.h"
 
 
 namespace fst {
@@ -41,24 +49,123 @@ class ThreeWayComposeStateTuple{
     StateId state1_, state2_, state3_;
 };
 
-template <typename Arc,
-          typename StateTuple = ThreeWayComposeStateTuple<typename Arc::StateId>,
-          typename StateTable = CompactHashStateTable<StateTuple, ComposeHash<StateTuple>>>
-class ThreeWayComposeStateTable : public StateTable {
+// Open addressing hash table from state tuples to state ids, numbered in the
+// order they are found.  Clear() empties only the slots in use and keeps the
+// memory, so that one table can be reused for many compositions.
+template <typename Arc>
+class ThreeWayComposeStateTable {
   public:
     using StateId = typename Arc::StateId;
+    using StateTuple = ThreeWayComposeStateTuple<StateId>;
+
+    ThreeWayComposeStateTable(): slots_(kInitialNumSlots, kNoStateId) {}
+
+    StateId FindState(const StateTuple &tuple) {
+      size_t slot = FindSlot(tuple);
+      if (slots_[slot] != kNoStateId) {
+        return slots_[slot];
+      }
 
-    ThreeWayComposeStateTable(const Fst<Arc> &fst1, const Fst<Arc> &fst2, const Fst<Arc> &fst3) {}
+      StateId state = tuples_.size();
+      slots_[slot] = state;
+      tuples_.push_back(tuple);
+      state_slots_.push_back(slot);
+      if (2 * tuples_.size() > slots_.size()) {
+        Rehash(2 * slots_.size());
+      }
+      return state;
+    }
+
+    const StateTuple &Tuple(StateId state) const {
+      return tuples_[state];
+    }
 
-    ThreeWayComposeStateTable(const Fst<Arc> &fst1, const Fst<Arc> &fst2, const Fst<Arc> &fst3, size_t table_size)
-        : StateTable(table_size) {}
+    StateId Size() const {
+      return tuples_.size();
+    }
 
-   constexpr bool Error() const { return false; }
+    void Clear() {
+      for (size_t slot: state_slots_) {
+        slots_[slot] = kNoStateId;
+      }
+      tuples_.clear();
+      state_slots_.clear();
+    }
 
   private:
-    ThreeWayComposeStateTable &operator=(const ThreeWayComposeStateTable &table) = delete;
+    static const size_t kInitialNumSlots = 1024;
+
+    static size_t Hash(const StateTuple &tuple) {
+      uint64_t h = static_cast<uint64_t>(tuple.StateId1()) * 0x9e3779b97f4a7c15ULL;
+      h ^= static_cast<uint64_t>(tuple.StateId2()) * 0xc2b2ae3d27d4eb4fULL;
+      h ^= static_cast<uint64_t>(tuple.StateId3()) * 0x165667b19e3779f9ULL;
+      return h ^ (h >> 29);
+    }
+
+    // Slot of tuple, or the empty slot where it would go.
+    size_t FindSlot(const StateTuple &tuple) const {
+      size_t mask = slots_.size() - 1;
+      size_t slot = Hash(tuple) & mask;
+      while (slots_[slot] != kNoStateId && !(tuples_[slots_[slot]] == tuple)) {
+        slot = (slot + 1) & mask;
+      }
+      return slot;
+    }
+
+    void Rehash(size_t num_slots) {
+      slots_.assign(num_slots, kNoStateId);
+      for (StateId state = 0; state < tuples_.size(); state++) {
+        size_t slot = FindSlot(tuples_[state]);
+        slots_[slot] = state;
+        state_slots_[state] = slot;
+      }
+    }
+
+    std::vector<StateId> slots_;
+    std::vector<StateTuple> tuples_;
+    std::vector<size_t> state_slots_;
+};
+
+struct ThreeWayComposeOptions {
+  int steps_threshold;
+  float prune_beam;
+  int max_paths;
+  // Start states of fst2 and fst3; kNoStateId means the fsts' own start states.
+  int start2, start3;
+  // Whether states are final as soon as fst1 is final, regardless of fst3.
+  // Used to compose chunks of an observation whose LM state carries over.
+  bool partial;
+  // Number of threads expanding the states of each observation position;
+  // only used when fst1 is topologically sorted and max_paths is not 1.
+  // Their states are then pruned with prune_beam against the best of them
+  // rather than by the queue, so steps_threshold is not used and the output
+  // differs from that of a single thread.
+  int num_threads;
+  // If not NULL, a lower bound on the cost from every state of fst3 to a
+  // final state (see ComputeLookaheadPotentials), added to the distance of
+  // every state for queueing and pruning.
+  const std::vector<float> *potentials3;
+
+  ThreeWayComposeOptions(int steps_threshold = 5, float prune_beam = 8, int max_paths = -1)
+      : steps_threshold(steps_threshold), prune_beam(prune_beam), max_paths(max_paths),
+        start2(kNoStateId), start3(kNoStateId), partial(false), num_threads(1), potentials3(NULL) {}
 };
 
+// Tropical cost of the best path from every state of ifst to a final state,
+// infinity if there is none.  Since arc costs are not negative, it bounds the
+// cost that fst3 of a ThreeWayComposition adds after a state from below.
+template <class Arc>
+void ComputeLookaheadPotentials(const VectorFst<Arc> &ifst, std::vector<float> *potentials) {
+  VectorFst<StdArc> tropical_fst;
+  ArcMap(ifst, &tropical_fst, WeightConvertMapper<Arc, StdArc>());
+  std::vector<TropicalWeight> distance;
+  ShortestDistance(tropical_fst, &distance, /*reverse=*/true);
+  potentials->assign(ifst.NumStates(), TropicalWeight::Zero().Value());
+  for (size_t state = 0; state < distance.size() && state < potentials->size(); state++) {
+    (*potentials)[state] = distance[state].Value();
+  }
+}
+
 template <typename Arc>
 struct BeamSearchStateEquivClass {
   public:
@@ -79,6 +186,10 @@ class DenseMatcher {
   using Label = typename Arc::Label;
 
   public:
+    // Missing arcs are returned as an arc with kNoLabel labels.
+    explicit DenseMatcher(const VectorFst<Arc> &fst)
+      : DenseMatcher(fst, Arc(kNoLabel, kNoLabel, Arc::Weight::Zero(), kNoStateId)) {}
+
     DenseMatcher(const VectorFst<Arc> &fst, const Arc &default_arc)
       : table_(fst.NumStates(), HighestNumberedInputSymbol(fst) + 1, HighestNumberedOutputSymbol(fst) + 1, default_arc) {
       for (StateIterator<Fst<Arc>> siter(fst); !siter.Done(); siter.Next()) {
@@ -98,23 +209,158 @@ class DenseMatcher {
     Table<Arc> table_;
 };
 
+// Cost by which the search orders and prunes states.  A lattice weight counts
+// with both of its components, as in Kaldi's own lattice pruning.
+template <class T>
+inline float SearchCost(const TropicalWeightTpl<T> &weight) { return weight.Value(); }
+
+template <class T>
+inline float SearchCost(const LogWeightTpl<T> &weight) { return weight.Value(); }
+
+template <class T>
+inline float SearchCost(const LatticeWeightTpl<T> &weight) { return weight.Value1() + weight.Value2(); }
+
+// Threads that run work(t) for t in 1..num_threads-1 on every call to Run,
+// while the calling thread runs work(0).  They wait between calls instead of
+// exiting, so a loop of many short parallel steps starts them only once.
+class WorkerGroup {
+  public:
+    WorkerGroup(size_t num_threads, std::function<void(size_t)> work)
+        : work_(std::move(work)), generation_(0), num_busy_(0), stop_(false) {
+      for (size_t t = 1; t < num_threads; t++) {
+        threads_.push_back(std::thread([this, t] { Loop(t); }));
+      }
+    }
+
+    ~WorkerGroup() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+      }
+      start_.notify_all();
+      for (auto &thread: threads_) {
+        thread.join();
+      }
+    }
+
+    // Returns once work(t) has returned for every t.
+    void Run() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        generation_++;
+        num_busy_ = threads_.size();
+      }
+      start_.notify_all();
+      work_(0);
+
+      std::unique_lock<std::mutex> lock(mutex_);
+      done_.wait(lock, [this] { return num_busy_ == 0; });
+    }
+
+  private:
+    void Loop(size_t t) {
+      size_t generation = 0;
+      while (true) {
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          start_.wait(lock, [this, generation] { return stop_ || generation_ != generation; });
+          if (stop_) {
+            return;
+          }
+          generation = generation_;
+        }
+
+        work_(t);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (--num_busy_ == 0) {
+          done_.notify_one();
+        }
+      }
+    }
+
+    std::function<void(size_t)> work_;
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable start_, done_;
+    size_t generation_, num_busy_;
+    bool stop_;
+};
+
 template<class Arc>
 class ThreeWayComposition {
   using StateId = typename Arc::StateId;
+  using Label = typename Arc::Label;
   using Weight = typename Arc::Weight;
-  typedef NaturalPruneQueue<PruneNaturalShortestFirstQueue<StateId, Weight>, Weight, BeamSearchStateEquivClass<Arc>> Queue;
+  // The search runs on tropical distances whatever the semiring of Arc, so
+  // that a log semiring composition is pruned like a tropical one while its
+  // arcs keep their log weights for forward-backward, and a lattice one keeps
+  // its cost components apart.
+  using SearchWeight = TropicalWeight;
+  typedef NaturalPruneQueue<PruneNaturalShortestFirstQueue<StateId, SearchWeight>, SearchWeight, BeamSearchStateEquivClass<Arc>> Queue;
   typedef ThreeWayComposeStateTuple<StateId> StateTuple;
 
+  // Arc found by a worker thread in parallel mode, added to ofst_ when merging.
+  struct PendingArc {
+    StateId state;
+    Label ilabel, olabel;
+    Weight weight, final_weight;
+    StateTuple next_tuple;
+  };
+
+  struct PendingArcs {
+    std::vector<PendingArc> arcs;
+    int64_t matcher_misses;
+
+    PendingArcs(): matcher_misses(0) {}
+  };
+
+  // Waves smaller than this are expanded on the calling thread.
+  static const size_t kMinParallelWaveSize = 64;
+
   public:
 
     ThreeWayComposition(const VectorFst<Arc> &fst1, const VectorFst<Arc> &fst2, const VectorFst<Arc> &fst3, int steps_threshold, float prune_beam, int max_paths)
-        : fst1_(fst1), fst2_(fst2), fst3_(fst3),
-          dm2_(fst2, Arc(kNoLabel, kNoLabel, Weight::Zero(), -1)),
-          state_table_(fst1_, fst2_, fst3_),
-          equivalence_class_(state_table_),
-          queue_(distance_, new PruneNaturalShortestFirstQueue<StateId, Weight>(distance_, steps_threshold), equivalence_class_, prune_beam),
-          max_paths_(max_paths), num_paths_(0), best_final_distance_(Weight::Zero()) {
-      Compose();
+        : ThreeWayComposition(fst1, fst2, fst3, ThreeWayComposeOptions(steps_threshold, prune_beam, max_paths)) {}
+
+    ThreeWayComposition(const VectorFst<Arc> &fst1, const VectorFst<Arc> &fst2, const VectorFst<Arc> &fst3, const ThreeWayComposeOptions &opts)
+        : ThreeWayComposition() {
+      owned_dm2_.reset(new DenseMatcher<Arc>(fst2));
+      Compose(fst1, fst2, fst3, *owned_dm2_, opts);
+    }
+
+    // An empty composition, whose state table, distances, queue and output
+    // are reused by every call to Compose.  Meant to be kept by a thread for
+    // all of its compositions.
+    ThreeWayComposition()
+        : equivalence_class_(state_table_), queue_steps_threshold_(-1), queue_prune_beam_(0) {}
+
+    // Replaces the composition by that of fst1, fst2 and fst3, where dm2 is a
+    // DenseMatcher of fst2, so that it is built once for all compositions.
+    // The fsts are only used during the call.
+    void Compose(const VectorFst<Arc> &fst1, const VectorFst<Arc> &fst2, const VectorFst<Arc> &fst3,
+                 const DenseMatcher<Arc> &dm2, const ThreeWayComposeOptions &opts) {
+      fst1_ = &fst1;
+      fst2_ = &fst2;
+      fst3_ = &fst3;
+      dm2_ = &dm2;
+      start2_ = opts.start2 != kNoStateId ? opts.start2 : fst2.Start();
+      start3_ = opts.start3 != kNoStateId ? opts.start3 : fst3.Start();
+      partial_ = opts.partial;
+      prune_beam_ = opts.prune_beam;
+      num_threads_ = opts.num_threads;
+      max_paths_ = opts.max_paths;
+      potentials3_ = opts.potentials3;
+      num_paths_ = 0;
+      best_final_state_ = kNoStateId;
+      best_final_distance_ = SearchWeight::Zero();
+      Clear(opts);
+
+      if (num_threads_ > 1 && max_paths_ != 1 && fst1_->Properties(kTopSorted, true) == kTopSorted) {
+        ComposeLayered();
+      } else {
+        ComposeShortestFirst();
+      }
     }
 
     const VectorFst<Arc> &GetFst() const {
@@ -125,51 +371,242 @@ class ThreeWayComposition {
       return state_table_;
     }
 
+    const DeciphermentStats &GetStats() const {
+      return stats_;
+    }
+
+    // Final state with the best distance including its final weight, or
+    // kNoStateId if no final state was reached.
+    StateId GetBestFinalState() const {
+      return best_final_state_;
+    }
+
+    // Tuple of the final state with the best distance seen during the search,
+    // or an empty tuple if no final state was reached.
+    StateTuple GetBestFinalTuple() const {
+      if (best_final_state_ == kNoStateId) {
+        return StateTuple();
+      }
+      return state_table_.Tuple(best_final_state_);
+    }
+
   private:
 
-    void Compose() {
-      assert(fst1_.Properties(kOLabelSorted, true) == kOLabelSorted);
-      assert(fst3_.Properties(kILabelSorted, true) == kILabelSorted);
+    // Empties the buffers of the previous composition without freeing them.
+    // The queue is only rebuilt when its parameters change.
+    void Clear(const ThreeWayComposeOptions &opts) {
+      ofst_.DeleteStates();
+      distance_.clear();
+      priority_.clear();
+      state_table_.Clear();
+      expanded_.clear();
+      pruned_.clear();
+      num_expanded_ = 0;
+      stats_ = DeciphermentStats();
+
+      if (queue_ == nullptr || queue_steps_threshold_ != opts.steps_threshold || queue_prune_beam_ != opts.prune_beam) {
+        queue_.reset(new Queue(priority_, new PruneNaturalShortestFirstQueue<StateId, SearchWeight>(priority_, opts.steps_threshold),
+                               equivalence_class_, opts.prune_beam));
+        queue_steps_threshold_ = opts.steps_threshold;
+        queue_prune_beam_ = opts.prune_beam;
+      } else {
+        queue_->Clear();
+      }
+    }
+
+    void ComposeShortestFirst() {
+      assert(fst1_->Properties(kOLabelSorted, true) == kOLabelSorted);
+      assert(fst3_->Properties(kILabelSorted, true) == kILabelSorted);
 
-      bool fst1_has_output_epsilons = fst1_.Properties(fst::kOEpsilons, true) != 0;
-      bool fst3_has_input_epsilons = fst3_.Properties(fst::kIEpsilons, true) != 0;
+      fst1_has_output_epsilons_ = fst1_->Properties(fst::kOEpsilons, true) != 0;
+      fst3_has_input_epsilons_ = fst3_->Properties(fst::kIEpsilons, true) != 0;
 
       ProcessStart();
-      while (!queue_.Empty()) {
-        StateId state = queue_.Head();
-        queue_.Dequeue();
+      while (!queue_->Empty()) {
+        StateId state = queue_->Head();
+        queue_->Dequeue();
 
-        const StateTuple tuple = state_table_.Tuple(state);
         if (max_paths_ == 1 && less_(best_final_distance_, distance_[state])) {
           break;
         }
 
-        // TODO: check whether this can be optimized in any other way? allocating fewer arcs?
-        if (fst1_has_output_epsilons) {
-          HandleOutputEpsilonsInFst1(state, tuple);
+        if (state >= expanded_.size()) {
+          expanded_.resize(ofst_.NumStates(), false);
         }
+        num_expanded_ += expanded_[state] ? 0 : 1;
+        expanded_[state] = true;
+
+        stats_.states_expanded++;
+        Expand(state, NULL);
+      }
 
-        if (fst3_has_input_epsilons) {
-          HandleInputEpsilonsInFst3(state, tuple);
+      stats_.beam_prunes += ofst_.NumStates() - num_expanded_;
+    }
+
+    // Expands the composition one state of fst1 at a time.  States sharing a
+    // state of fst1 (the BeamSearchStateEquivClass) do not depend on each
+    // other, so each wave of them is expanded by num_threads_ workers into
+    // separate arc buffers.  The buffers are merged in wave order, so the
+    // output is the same for any number of threads.  Instead of the queue,
+    // the states of a wave are pruned with prune_beam_ against the best state
+    // of their fst1 state, without steps_threshold.  An arc merged later in
+    // the layer, such as an fst3 backoff or an ali epsilon, can still improve
+    // a state of an earlier wave: a pruned one is then put back for the next
+    // wave and an expanded one passes the improvement on to its successors.
+    // The workers are started by the first wave large enough for them and
+    // kept for the rest of the composition, since most waves take less time
+    // than starting threads.
+    void ComposeLayered() {
+      assert(fst1_->Properties(kOLabelSorted, true) == kOLabelSorted);
+      assert(fst3_->Properties(kILabelSorted, true) == kILabelSorted);
+
+      fst1_has_output_epsilons_ = fst1_->Properties(fst::kOEpsilons, true) != 0;
+      fst3_has_input_epsilons_ = fst3_->Properties(fst::kIEpsilons, true) != 0;
+
+      for (auto &layer: layers_) {
+        layer.clear();
+      }
+      layers_.resize(fst1_->NumStates());
+      ofst_.DeleteStates();
+      ofst_.AddState();
+      ofst_.SetStart(0);
+      distance_.push_back(SearchWeight::One());
+      priority_.push_back(Priority(SearchWeight::One(), start3_));
+      layers_[fst1_->Start()].push_back(state_table_.FindState({fst1_->Start(), start2_, start3_}));
+
+      std::vector<PendingArcs> pending(num_threads_);
+      std::vector<StateId> wave;
+      size_t block_size = 0;
+      auto expand_block = [this, &wave, &block_size, &pending](size_t t) {
+        size_t wave_begin = std::min(t * block_size, wave.size());
+        size_t wave_end = std::min(wave_begin + block_size, wave.size());
+        for (size_t i = wave_begin; i < wave_end; i++) {
+          Expand(wave[i], &pending[t]);
         }
+      };
+      std::unique_ptr<WorkerGroup> workers;
+
+      for (StateId layer = 0; layer < layers_.size(); layer++) {
+        size_t begin = 0;
+        while (begin < layers_[layer].size()) {
+          const std::vector<StateId> &states = layers_[layer];
+          size_t end = states.size();
+
+          SearchWeight best_distance = SearchWeight::Zero();
+          for (StateId state: states) {
+            best_distance = less_(priority_[state], best_distance) ? priority_[state] : best_distance;
+          }
 
-        HandleOutputEpsilonsInFst2(state, tuple);
-        HandleInputEpsilonsInFst2(state, tuple);
-        HandleInputOutputEpsilonsInFst2(state, tuple);
-        HandleNonEpsilonArcs(state, tuple);
+          SearchWeight limit = Times(best_distance, SearchWeight(prune_beam_));
+          expanded_.resize(ofst_.NumStates(), false);
+          pruned_.resize(ofst_.NumStates(), false);
+          wave.clear();
+          for (size_t i = begin; i < end; i++) {
+            if (!less_(limit, priority_[states[i]])) {
+              wave.push_back(states[i]);
+              expanded_[states[i]] = true;
+            } else {
+              pruned_[states[i]] = true;
+            }
+          }
+          stats_.states_expanded += wave.size();
+          num_expanded_ += wave.size();
+          begin = end;
+
+          size_t num_threads = (wave.size() < kMinParallelWaveSize) ? 1 : num_threads_;
+          block_size = (wave.size() + num_threads - 1) / num_threads;
+          if (num_threads == 1) {
+            expand_block(0);
+          } else {
+            if (workers == NULL) {
+              workers.reset(new WorkerGroup(num_threads_, expand_block));
+            }
+            workers->Run();
+          }
+
+          for (size_t t = 0; t < num_threads; t++) {
+            for (const PendingArc &arc: pending[t].arcs) {
+              AddPendingArc(arc, layer);
+            }
+            stats_.matcher_misses += pending[t].matcher_misses;
+            pending[t].arcs.clear();
+            pending[t].matcher_misses = 0;
+          }
+          PropagateImproved(layer);
+        }
       }
+
+      stats_.beam_prunes += ofst_.NumStates() - num_expanded_;
+    }
+
+    // Called when the distance of state, whose fst1 state is state1, has
+    // improved while layer is expanded.  Only states of the layer itself can
+    // have been through a wave already.
+    void RequeueImproved(StateId state, StateId state1, StateId layer) {
+      if (state1 != layer || state >= expanded_.size()) {
+        return;
+      }
+
+      if (expanded_[state]) {
+        improved_.push_back(state);
+      } else if (pruned_[state]) {
+        pruned_[state] = false;
+        layers_[layer].push_back(state);
+      }
+    }
+
+    // Passes the improved distances of expanded states on along the arcs
+    // they already have, rather than expanding them again.
+    void PropagateImproved(StateId layer) {
+      while (!improved_.empty()) {
+        StateId state = improved_.back();
+        improved_.pop_back();
+        for (ArcIterator<VectorFst<Arc>> aiter(ofst_, state); !aiter.Done(); aiter.Next()) {
+          const Arc &arc = aiter.Value();
+          SearchWeight new_distance = Times(distance_[state], SearchWeight(SearchCost(arc.weight)));
+          if (!less_(new_distance, distance_[arc.nextstate])) {
+            continue;
+          }
+
+          StateTuple tuple = state_table_.Tuple(arc.nextstate);
+          distance_[arc.nextstate] = new_distance;
+          priority_[arc.nextstate] = Priority(new_distance, tuple.StateId3());
+          stats_.queue_updates++;
+          UpdateBestFinal(arc.nextstate, new_distance, ofst_.Final(arc.nextstate));
+          RequeueImproved(arc.nextstate, tuple.StateId1(), layer);
+        }
+      }
+    }
+
+    void Expand(StateId state, PendingArcs *pending) {
+      const StateTuple tuple = state_table_.Tuple(state);
+
+      // TODO: check whether this can be optimized in any other way? allocating fewer arcs?
+      if (fst1_has_output_epsilons_) {
+        HandleOutputEpsilonsInFst1(state, tuple, pending);
+      }
+
+      if (fst3_has_input_epsilons_) {
+        HandleInputEpsilonsInFst3(state, tuple, pending);
+      }
+
+      HandleOutputEpsilonsInFst2(state, tuple, pending);
+      HandleInputEpsilonsInFst2(state, tuple, pending);
+      HandleInputOutputEpsilonsInFst2(state, tuple, pending);
+      HandleNonEpsilonArcs(state, tuple, pending);
     }
 
     void ProcessStart() {
       ofst_.DeleteStates();
       ofst_.AddState();
       ofst_.SetStart(0);
-      distance_.push_back(Weight::One());
-      queue_.Enqueue(state_table_.FindState({fst1_.Start(), fst2_.Start(), fst3_.Start()}));
+      distance_.push_back(SearchWeight::One());
+      priority_.push_back(Priority(SearchWeight::One(), start3_));
+      queue_->Enqueue(state_table_.FindState({fst1_->Start(), start2_, start3_}));
     }
 
-    void HandleOutputEpsilonsInFst1(StateId state, StateTuple tuple) {
-      for (ArcIterator<Fst<Arc>> aiter1(fst1_, tuple.StateId1()); !aiter1.Done(); aiter1.Next()) {
+    void HandleOutputEpsilonsInFst1(StateId state, StateTuple tuple, PendingArcs *pending) {
+      for (ArcIterator<Fst<Arc>> aiter1(*fst1_, tuple.StateId1()); !aiter1.Done(); aiter1.Next()) {
         const Arc &arc1 = aiter1.Value();
         if (arc1.olabel > 0) {
           break;
@@ -177,45 +614,45 @@ class ThreeWayComposition {
         const Arc arc2(0, 0, Arc::Weight::One(), tuple.StateId2());
         const Arc arc3(0, 0, Arc::Weight::One(), tuple.StateId3());
 
-        AddArc(state, arc1, arc2, arc3);
+        AddArc(state, arc1, arc2, arc3, pending);
       }
     }
 
-    void HandleOutputEpsilonsInFst2(StateId state, StateTuple tuple) {
-      for (ArcIterator<Fst<Arc>> aiter1(fst1_, tuple.StateId1()); !aiter1.Done(); aiter1.Next()) {
+    void HandleOutputEpsilonsInFst2(StateId state, StateTuple tuple, PendingArcs *pending) {
+      for (ArcIterator<Fst<Arc>> aiter1(*fst1_, tuple.StateId1()); !aiter1.Done(); aiter1.Next()) {
         const Arc &arc1 = aiter1.Value();
         const Arc arc3(0, 0, Arc::Weight::One(), tuple.StateId3());
         if (arc1.olabel == 0) {
           continue;
         }
 
-        const Arc &arc2 = dm2_.GetArc(tuple.StateId2(), arc1.olabel, arc3.ilabel);
-        AddArc(state, arc1, arc2, arc3);
+        const Arc &arc2 = dm2_->GetArc(tuple.StateId2(), arc1.olabel, arc3.ilabel);
+        AddArc(state, arc1, arc2, arc3, pending);
       }
     }
 
-    void HandleInputEpsilonsInFst2(StateId state, StateTuple tuple) {
-      for (ArcIterator<Fst<Arc>> aiter3(fst3_, tuple.StateId3()); !aiter3.Done(); aiter3.Next()) {
+    void HandleInputEpsilonsInFst2(StateId state, StateTuple tuple, PendingArcs *pending) {
+      for (ArcIterator<Fst<Arc>> aiter3(*fst3_, tuple.StateId3()); !aiter3.Done(); aiter3.Next()) {
         const Arc arc1(0, 0, Arc::Weight::One(), tuple.StateId1());
         const Arc &arc3 = aiter3.Value();
         if (arc3.ilabel == 0) {
           continue;
         }
 
-        const Arc &arc2 = dm2_.GetArc(tuple.StateId2(), arc1.olabel, arc3.ilabel);
-        AddArc(state, arc1, arc2, arc3);
+        const Arc &arc2 = dm2_->GetArc(tuple.StateId2(), arc1.olabel, arc3.ilabel);
+        AddArc(state, arc1, arc2, arc3, pending);
       }
     }
 
-    void HandleInputOutputEpsilonsInFst2(StateId state, StateTuple tuple) {
+    void HandleInputOutputEpsilonsInFst2(StateId state, StateTuple tuple, PendingArcs *pending) {
       const Arc arc1(0, 0, Arc::Weight::One(), tuple.StateId1());
       const Arc arc3(0, 0, Arc::Weight::One(), tuple.StateId3());
-      const Arc &arc2 = dm2_.GetArc(tuple.StateId2(), 0, 0);
-      AddArc(state, arc1, arc2, arc3);
+      const Arc &arc2 = dm2_->GetArc(tuple.StateId2(), 0, 0);
+      AddArc(state, arc1, arc2, arc3, pending);
     }
 
-    void HandleInputEpsilonsInFst3(StateId state, StateTuple tuple) {
-      for (ArcIterator<Fst<Arc>> aiter3(fst3_, tuple.StateId3()); !aiter3.Done(); aiter3.Next()) {
+    void HandleInputEpsilonsInFst3(StateId state, StateTuple tuple, PendingArcs *pending) {
+      for (ArcIterator<Fst<Arc>> aiter3(*fst3_, tuple.StateId3()); !aiter3.Done(); aiter3.Next()) {
         const Arc &arc3 = aiter3.Value();
         if (arc3.ilabel > 0) {
           break;
@@ -223,70 +660,145 @@ class ThreeWayComposition {
         const Arc arc1(0, 0, Arc::Weight::One(), tuple.StateId1());
         const Arc arc2(0, 0, Arc::Weight::One(), tuple.StateId2());
 
-        AddArc(state, arc1, arc2, arc3);
+        AddArc(state, arc1, arc2, arc3, pending);
       }
     }
 
-    void HandleNonEpsilonArcs(StateId state, StateTuple tuple) {
-      for (ArcIterator<Fst<Arc>> aiter1(fst1_, tuple.StateId1()); !aiter1.Done(); aiter1.Next()) {
+    void HandleNonEpsilonArcs(StateId state, StateTuple tuple, PendingArcs *pending) {
+      for (ArcIterator<Fst<Arc>> aiter1(*fst1_, tuple.StateId1()); !aiter1.Done(); aiter1.Next()) {
         const Arc &arc1 = aiter1.Value();
         if (arc1.olabel == 0) {
           continue;
         }
 
-        for (ArcIterator<Fst<Arc>> aiter3(fst3_, tuple.StateId3()); !aiter3.Done(); aiter3.Next()) {
+        for (ArcIterator<Fst<Arc>> aiter3(*fst3_, tuple.StateId3()); !aiter3.Done(); aiter3.Next()) {
           const Arc &arc3 = aiter3.Value();
           if (arc3.ilabel == 0) {
             continue;
           }
 
-          const Arc &arc2 = dm2_.GetArc(tuple.StateId2(), arc1.olabel, arc3.ilabel);
-          AddArc(state, arc1, arc2, arc3);
+          const Arc &arc2 = dm2_->GetArc(tuple.StateId2(), arc1.olabel, arc3.ilabel);
+          AddArc(state, arc1, arc2, arc3, pending);
         }
       }
     }
 
-    void AddArc(StateId state, const Arc &arc1, const Arc &arc2, const Arc &arc3) {
+    void AddArc(StateId state, const Arc &arc1, const Arc &arc2, const Arc &arc3, PendingArcs *pending) {
       if (arc2.ilabel == kNoLabel && arc2.olabel == kNoLabel) {
+        if (pending != NULL) {
+          pending->matcher_misses++;
+        } else {
+          stats_.matcher_misses++;
+        }
         return;
       }
 
-      StateId nextstate = state_table_.FindState({arc1.nextstate, arc2.nextstate, arc3.nextstate});
       Weight weight = Times(arc1.weight, Times(arc2.weight, arc3.weight));
-      Weight new_distance = Times(distance_[state], weight);
-      Weight final_weight = Times(fst1_.Final(arc1.nextstate), Times(fst2_.Final(arc2.nextstate), fst3_.Final(arc3.nextstate)));
+      Weight final_weight = Times(fst1_->Final(arc1.nextstate), fst2_->Final(arc2.nextstate));
+      if (!partial_) {
+        final_weight = Times(final_weight, fst3_->Final(arc3.nextstate));
+      }
+
+      if (pending != NULL) {
+        pending->arcs.push_back({state, arc1.ilabel, arc3.olabel, weight, final_weight, {arc1.nextstate, arc2.nextstate, arc3.nextstate}});
+        return;
+      }
+
+      StateId nextstate = state_table_.FindState({arc1.nextstate, arc2.nextstate, arc3.nextstate});
+      SearchWeight new_distance = Times(distance_[state], SearchWeight(SearchCost(weight)));
+
+      if (nextstate == ofst_.NumStates()) {
+        distance_.push_back(new_distance);
+        priority_.push_back(Priority(new_distance, arc3.nextstate));
+        queue_->Enqueue(nextstate);
+        ofst_.AddState();
+      } else if (less_(new_distance, distance_[nextstate])) {
+        distance_[nextstate] = new_distance;
+        priority_[nextstate] = Priority(new_distance, arc3.nextstate);
+        queue_->Update(nextstate);
+        stats_.queue_updates++;
+      }
+
+      AddFinalAndArc(state, nextstate, arc1.ilabel, arc3.olabel, weight, new_distance, final_weight);
+    }
+
+    void AddPendingArc(const PendingArc &arc, StateId layer) {
+      StateId nextstate = state_table_.FindState(arc.next_tuple);
+      SearchWeight new_distance = Times(distance_[arc.state], SearchWeight(SearchCost(arc.weight)));
 
       if (nextstate == ofst_.NumStates()) {
         distance_.push_back(new_distance);
-        queue_.Enqueue(nextstate);
+        priority_.push_back(Priority(new_distance, arc.next_tuple.StateId3()));
+        layers_[arc.next_tuple.StateId1()].push_back(nextstate);
         ofst_.AddState();
       } else if (less_(new_distance, distance_[nextstate])) {
         distance_[nextstate] = new_distance;
-        queue_.Update(nextstate);
+        priority_[nextstate] = Priority(new_distance, arc.next_tuple.StateId3());
+        stats_.queue_updates++;
+        RequeueImproved(nextstate, arc.next_tuple.StateId1(), layer);
       }
 
+      AddFinalAndArc(arc.state, nextstate, arc.ilabel, arc.olabel, arc.weight, new_distance, arc.final_weight);
+    }
+
+    SearchWeight Priority(SearchWeight distance, StateId state3) const {
+      return potentials3_ == NULL ? distance : Times(distance, SearchWeight((*potentials3_)[state3]));
+    }
+
+    void AddFinalAndArc(StateId state, StateId nextstate, Label ilabel, Label olabel, Weight weight, SearchWeight new_distance, Weight final_weight) {
       if (final_weight != Weight::Zero()) {
         ofst_.SetFinal(nextstate, final_weight);
-        if (less_(Times(new_distance, final_weight), best_final_distance_)) {
-          best_final_distance_ = Times(new_distance, final_weight);
-        }
+        UpdateBestFinal(nextstate, new_distance, final_weight);
+      }
+
+      ofst_.AddArc(state, Arc(ilabel, olabel, weight, nextstate));
+      stats_.arcs_added++;
+    }
+
+    void UpdateBestFinal(StateId state, SearchWeight distance, Weight final_weight) {
+      if (final_weight == Weight::Zero()) {
+        return;
       }
 
-      ofst_.AddArc(state, Arc(arc1.ilabel, arc3.olabel, weight, nextstate));
+      SearchWeight final_distance = Times(distance, SearchWeight(SearchCost(final_weight)));
+      if (less_(final_distance, best_final_distance_)) {
+        best_final_distance_ = final_distance;
+        best_final_state_ = state;
+      }
     }
 
-    VectorFst<Arc> fst1_, fst2_, fst3_;
-    DenseMatcher<Arc> dm2_;
+    const VectorFst<Arc> *fst1_, *fst2_, *fst3_;
+    const DenseMatcher<Arc> *dm2_;
+    std::unique_ptr<DenseMatcher<Arc>> owned_dm2_;
     VectorFst<Arc> ofst_;
 
-    std::vector<Weight> distance_;
+    // Distances from the start, and the same plus the lookahead potential of
+    // the fst3 state, by which states are queued and pruned.
+    std::vector<SearchWeight> distance_, priority_;
+    const std::vector<float> *potentials3_;
     ThreeWayComposeStateTable<Arc> state_table_;
     BeamSearchStateEquivClass<Arc> equivalence_class_;
-    Queue queue_;
-
+    std::unique_ptr<Queue> queue_;
+    int queue_steps_threshold_;
+    float queue_prune_beam_;
+    std::vector<std::vector<StateId>> layers_;
+
+    StateId start2_, start3_;
+    bool partial_;
+    float prune_beam_;
+    int num_threads_;
+    bool fst1_has_output_epsilons_, fst3_has_input_epsilons_;
     int max_paths_, num_paths_;
-    Weight best_final_distance_;
-    NaturalLess<Weight> less_;
+    StateId best_final_state_;
+    SearchWeight best_final_distance_;
+    NaturalLess<SearchWeight> less_;
+
+    // States expanded, and in ComposeLayered states pruned by a wave and
+    // expanded ones whose distance improved since.
+    std::vector<bool> expanded_, pruned_;
+    std::vector<StateId> improved_;
+    StateId num_expanded_ = 0;
+    DeciphermentStats stats_;
 
 };
 
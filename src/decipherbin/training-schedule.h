@@ -0,0 +1,107 @@
+#ifndef DECIPHERMENT_TRAINING_SCHEDULE_H_
+#define DECIPHERMENT_TRAINING_SCHEDULE_H_
+
+#include <string>
+#include <vector>
+
+#include "base/kaldi-common.h"
+#include "util/text-utils.h"
+
+// One stage of decipherment-learn: iterations of EM with one LM and composer,
+// optionally preceded by pruning or smoothing of the lexical model.
+struct TrainingStage {
+  std::string lm_fst_filename;
+  int num_iters;
+  bool threeway;
+  bool train_lex;
+  bool train_ali;
+  float prune_beam;
+  // If >0, the beam of the first iteration, widened towards prune_beam as
+  // the likelihood converges.
+  float initial_prune_beam;
+  // If >0, observations whose composition is empty or too small are
+  // composed again with this beam.
+  float retry_prune_beam;
+  int steps_threshold;
+  int prune_top;
+  float smooth_alpha;
+  int viterbi_nbest;
+
+  TrainingStage(): num_iters(10), threeway(false), train_lex(true), train_ali(true),
+                   prune_beam(8), initial_prune_beam(0), retry_prune_beam(0), steps_threshold(5), prune_top(0), smooth_alpha(0), viterbi_nbest(0) {}
+};
+
+// Parses stages separated by commas, each written as
+//   <lm-filename>:<num-iters>:<standard|threeway>[:<key>=<value>...]
+// with keys train-lex, train-ali, prune-beam, initial-prune-beam,
+// retry-prune-beam, steps-threshold, viterbi (number
+// of best paths to train on, 0 for all paths), prune-top (keep this many
+// targets per source before the stage) and smooth (interpolate with a uniform
+// model before the stage).  Options not given in a stage are taken
+// from defaults, e.g.
+//   lm.3gm.fst:20:standard:prune-top=20,lm.4gm.fst:20:standard,LG.fst:20:threeway:smooth=0.9
+inline void ParseTrainingSchedule(
+    const std::string &schedule, const TrainingStage &defaults, std::vector<TrainingStage> *stages
+) {
+  std::vector<std::string> stage_strings;
+  kaldi::SplitStringToVector(schedule, ",", true, &stage_strings);
+  stages->clear();
+  for (const std::string &stage_string: stage_strings) {
+    std::vector<std::string> fields;
+    kaldi::SplitStringToVector(stage_string, ":", false, &fields);
+    if (fields.size() < 3) {
+      KALDI_ERR << "Stage " << stage_string << " should be <lm-filename>:<num-iters>:<composer>[:<key>=<value>...]";
+    }
+
+    TrainingStage stage = defaults;
+    stage.lm_fst_filename = fields[0];
+    if (!kaldi::ConvertStringToInteger(fields[1], &stage.num_iters) || stage.num_iters < 0) {
+      KALDI_ERR << "Bad number of iterations in stage " << stage_string;
+    }
+    if (fields[2] != "standard" && fields[2] != "threeway") {
+      KALDI_ERR << "Composer in stage " << stage_string << " should be standard or threeway";
+    }
+    stage.threeway = fields[2] == "threeway";
+
+    for (size_t i = 3; i < fields.size(); i++) {
+      std::vector<std::string> option;
+      kaldi::SplitStringToVector(fields[i], "=", false, &option);
+      bool ok = option.size() == 2;
+      if (ok && option[0] == "train-lex") {
+        ok = option[1] == "true" || option[1] == "false";
+        stage.train_lex = option[1] == "true";
+      } else if (ok && option[0] == "train-ali") {
+        ok = option[1] == "true" || option[1] == "false";
+        stage.train_ali = option[1] == "true";
+      } else if (ok && option[0] == "prune-beam") {
+        ok = kaldi::ConvertStringToReal(option[1], &stage.prune_beam);
+      } else if (ok && option[0] == "initial-prune-beam") {
+        ok = kaldi::ConvertStringToReal(option[1], &stage.initial_prune_beam);
+      } else if (ok && option[0] == "retry-prune-beam") {
+        ok = kaldi::ConvertStringToReal(option[1], &stage.retry_prune_beam);
+      } else if (ok && option[0] == "steps-threshold") {
+        ok = kaldi::ConvertStringToInteger(option[1], &stage.steps_threshold);
+      } else if (ok && option[0] == "viterbi") {
+        ok = kaldi::ConvertStringToInteger(option[1], &stage.viterbi_nbest);
+      } else if (ok && option[0] == "prune-top") {
+        ok = kaldi::ConvertStringToInteger(option[1], &stage.prune_top);
+      } else if (ok && option[0] == "smooth") {
+        ok = kaldi::ConvertStringToReal(option[1], &stage.smooth_alpha);
+      } else {
+        ok = false;
+      }
+
+      if (!ok) {
+        KALDI_ERR << "Bad option " << fields[i] << " in stage " << stage_string;
+      }
+    }
+
+    stages->push_back(stage);
+  }
+
+  if (stages->empty()) {
+    KALDI_ERR << "Empty schedule " << schedule;
+  }
+}
+
+#endif  // DECIPHERMENT_TRAINING_SCHEDULE_H_